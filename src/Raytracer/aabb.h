@@ -0,0 +1,57 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "interval.h"
+#include "vec3.h"
+
+// Axis-aligned bounding box, stored as one interval per axis.
+class aabb {
+    public:
+        interval x, y, z;
+
+        aabb() {} // The default AABB is empty, since intervals are empty by default.
+
+        aabb(const interval& x, const interval& y, const interval& z)
+          : x(x), y(y), z(z) {}
+
+        aabb(const point3& a, const point3& b) {
+            // Treat the two points a and b as extrema for the bounding box, so we don't require a
+            // particular minimum/maximum coordinate order.
+            x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+            y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+            z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+        }
+
+        aabb(const aabb& box0, const aabb& box1) {
+            x = interval(box0.x, box1.x);
+            y = interval(box0.y, box1.y);
+            z = interval(box0.z, box1.z);
+        }
+
+        const interval& axis_interval(int n) const {
+            if (n == 1) return y;
+            if (n == 2) return z;
+            return x;
+        }
+
+        bool is_empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
+        // False for boxes extending to infinity, such as aabb::universe.
+        bool is_bounded() const {
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = axis_interval(axis);
+                if (!(std::isfinite(extent.min) && std::isfinite(extent.max)))
+                    return false;
+            }
+            return true;
+        }
+
+        static const aabb empty, universe;
+};
+
+const aabb aabb::empty    = aabb(interval::empty,    interval::empty,    interval::empty);
+const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+
+#endif
@@ -2,8 +2,17 @@
 #define CAMERA_H
 
 #include "bmpwriter.h"
+#include "environment.h"
+#include "guiding.h"
 #include "hittable.h"
+#include "hittable_list.h"
 #include "material.h"
+#include "pfm.h"
+#include "quality.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
 
 class camera {
     public:
@@ -22,9 +31,88 @@ class camera {
         double shutter_speed = 1.0 / 60.0;  // Length of time camera shutter remains open
         int total_frames = 100;             // Total number of frames to be rendered
         int fps = 24;                       // Number of frames per second
+        double frame_budget = 0;            // Wall-clock seconds per frame; if positive, overrides samples_per_pixel
+
+        bool   sky              = true;               // Light the scene with the blue-white gradient sky
+        colour background       = colour(0,0,0);      // Scene background colour when the sky is disabled
+        bool   light_sampling   = true;               // Sample lights directly (next-event estimation with MIS)
+        shared_ptr<environment_light> environment;   // HDR environment lighting; replaces the sky if set
+
+        int    guiding_training_passes = 0;   // Passes per frame spent learning the path guiding cache; 0 disables guiding
+        double guiding_cell_size       = 1.0; // Edge length of the guiding cache's spatial cells
+        double guiding_fraction        = 0.5; // Probability that a guided diffuse bounce samples the cache, not the BSDF
+
+        bool tile_culling = true;           // Test camera rays only against objects that may be visible in their screen tile
+        int  packet_size  = 0;              // Trace camera rays in packets of 2x2, 4x4 or 8x8 pixels; other values trace them singly
+
+        bool        write_linear = false;   // Also write each frame as a linear PFM image, e.g. as a reference
+        std::string reference;              // Base name of per-frame PFM references to measure error against
 
         void render(const hittable& world, int argc, char* argv[], int frame, double frame_time) {
+            lights = nullptr;
+            render_frame(world, argc, argv, frame, frame_time);
+        }
+
+        // Renders a frame in which the objects in `lights` are also sampled explicitly from every
+        // diffuse hit. Lights must additionally be part of `world` to be visible.
+        void render(const hittable& world, const hittable_list& lights, int argc, char* argv[], int frame,
+                    double frame_time) {
+            this->lights = &lights;
+            render_frame(world, argc, argv, frame, frame_time);
+            this->lights = nullptr;
+        }
+
+        // Sample count and estimated RMS error of the most recently rendered frame. The error
+        // estimate is only available for frames rendered to a frame_budget and is -1 otherwise.
+        int last_samples_per_pixel() const { return samples_reached; }
+        double last_error_estimate() const { return error_estimate; }
+
+        // Error of the most recently rendered frame against its reference image, or -1 for both
+        // measures if no reference was set or it could not be read.
+        image_error last_reference_error() const { return reference_error; }
+
+    private:
+        // A point on a frame's error-versus-time curve.
+        struct convergence_point {
+            double seconds;
+            int samples;
+            image_error error;
+        };
+
+        int    samples_reached = 0;  // Samples per pixel taken for the last frame
+        int    expected_samples = 1; // Samples per pixel the current frame is expected to reach
+        double error_estimate = -1;  // Estimated RMS error of the last frame
+        image_error reference_error = {-1, -1};     // Error against the reference for the last frame
+        std::vector<colour> reference_pixels;       // Reference image for the current frame, if any
+        std::vector<convergence_point> convergence; // Error against the reference after each pass
+        const hittable_list* lights = nullptr; // Lights sampled explicitly during the current frame
+        shared_ptr<guiding_cache> guide;       // Path guiding cache for the current frame, if enabled
+        static const int tile_size = 16;            // Edge length in pixels of the screen tiles used for culling
+        int tiles_x = 0;                            // Number of tile columns
+        std::vector<std::vector<int>> tile_candidates; // Primitives each tile's camera rays can hit; empty if not culling
+        std::vector<int> all_primitives;            // Every primitive of the world, used when not culling
+        const hittable_collection* scene_objects = nullptr; // The world, if it is a hittable_collection
+        std::vector<ray> camera_rays;               // Camera rays for the rows being traced
+        std::vector<hit_record> camera_hits;        // First hits of those rays
+        std::vector<char> camera_hit_found;         // Whether each of those rays hit anything
+        long long primary_rays = 0;                 // Camera rays traced in the current frame
+        double primary_seconds = 0;                 // Time spent finding their first hits
+        int    image_height;        // Rendered image height
+        double pixel_samples_scale; // Colour scale factor for a sum of pixel samples
+        point3 centre;              // Camera center
+        point3 pixel00_loc;         // Location of pixel 0, 0
+        vec3   pixel_delta_u;       // Offset to pixel to the right
+        vec3   pixel_delta_v;       // Offset to pixel below
+        vec3   u, v, w;             // Camera frame basis vectors
+        vec3 defocus_disk_u;        // Defocus disk horizontal radius
+        vec3 defocus_disk_v;        // Defocus disk vertical radius
+
+        void render_frame(const hittable& world, int argc, char* argv[], int frame, double frame_time) {
+            TRACE_SCOPE_ARG("frame", "frame", frame + 1);
+            auto frame_start = std::chrono::steady_clock::now();
             initialise();
+            load_reference(frame);
+            build_tile_candidates(world, frame_time);
 
             // Allocate memory for the 2D pixel data array.
             colour** pixel_data = new colour*[image_height];
@@ -32,19 +120,40 @@ class camera {
                 pixel_data[j] = new colour[image_width];
             }
 
-            for (int j = 0; j < image_height; j++) {
-                std::clog << "\rFrame " << frame + 1 << "/" << total_frames 
-                        << " scanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    colour pixel_colour(0,0,0);
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j, frame_time);
-                        pixel_colour += ray_colour(r, max_depth, world);
-                    }
-                    pixel_data[j][i] = pixel_samples_scale * pixel_colour;
-                }
+            // Pick the render loop specialised for this frame's lens and shutter once, so that the
+            // per-sample ray generation carries no tests for either.
+            bool thin_lens = defocus_angle > 0;
+            bool motion_blur = shutter_speed > 0;
+            if (thin_lens && motion_blur)
+                render_samples<true, true>(world, pixel_data, frame, frame_time, frame_start);
+            else if (thin_lens)
+                render_samples<true, false>(world, pixel_data, frame, frame_time, frame_start);
+            else if (motion_blur)
+                render_samples<false, true>(world, pixel_data, frame, frame_time, frame_start);
+            else
+                render_samples<false, false>(world, pixel_data, frame, frame_time, frame_start);
+
+            std::clog << "\rFrame " << frame + 1 << " primary visibility: " << std::fixed << std::setprecision(2)
+                      << primary_rays / std::fmax(primary_seconds, 1e-9) / 1e6 << " Mrays/s (";
+            if (packet_tracing())
+                std::clog << packet_size << "x" << packet_size << " packets";
+            else
+                std::clog << "single rays";
+            std::clog << ")" << std::defaultfloat << std::setprecision(6) << "          \n";
+
+            if (!reference_pixels.empty()) {
+                reference_error = compare_to_reference(pixel_data, 1.0, reference_pixels, image_width, image_height);
+                if (convergence.empty())
+                    convergence.push_back({seconds_since(frame_start), samples_reached, reference_error});
+                report_reference_error(frame, output_name(argc, argv));
+            }
+
+            {
+                TRACE_SCOPE("write_bmp");
+                write_bmp(argc, argv, image_width, image_height, pixel_data, frame);
             }
-            write_bmp(argc, argv, image_width, image_height, pixel_data, frame);
+            if (write_linear)
+                write_pfm(frame_filename(output_name(argc, argv), frame, ".pfm"), image_width, image_height, pixel_data);
 
             // Deallocate memory for the pixel_data array once rendering is complete.
             for (int j = 0; j < image_height; j++) {
@@ -52,21 +161,13 @@ class camera {
             }
             delete[] pixel_data;
 
-            std::clog << "\rFrame " << frame + 1 << " rendered successfully.                     \n";
+            std::clog << "\rFrame " << frame + 1 << " rendered successfully in " << std::fixed
+                      << std::setprecision(2) << seconds_since(frame_start) << "s."
+                      << std::defaultfloat << std::setprecision(6) << "                     \n";
         }
 
-    private:
-        int    image_height;        // Rendered image height
-        double pixel_samples_scale; // Colour scale factor for a sum of pixel samples
-        point3 centre;              // Camera center
-        point3 pixel00_loc;         // Location of pixel 0, 0
-        vec3   pixel_delta_u;       // Offset to pixel to the right
-        vec3   pixel_delta_v;       // Offset to pixel below
-        vec3   u, v, w;             // Camera frame basis vectors
-        vec3 defocus_disk_u;        // Defocus disk horizontal radius
-        vec3 defocus_disk_v;        // Defocus disk vertical radius
-
         void initialise() {
+            TRACE_SCOPE("initialise");
             image_height = int(image_width / aspect_ratio);
             image_height = (image_height < 1) ? 1 : image_height;
 
@@ -103,20 +204,282 @@ class camera {
             defocus_disk_v = v * defocus_radius;
         }
 
+        void build_tile_candidates(const hittable& world, double frame_time) {
+            // Camera rays start on the defocus disk and pass through their pixel on the focus plane
+            // during the shutter interval, so each screen tile sees a frustum widened by the lens
+            // aperture. Objects whose bounds over the shutter interval miss a tile's frustum cannot
+            // be the first hit of any of its camera rays. Only the primitives of a
+            // hittable_collection world are culled; scattered and shadow rays still see the whole world.
+            TRACE_SCOPE("cull tiles");
+            tile_candidates.clear();
+            all_primitives.clear();
+            auto scene = scene_objects = dynamic_cast<const hittable_collection*>(&world);
+            if (!scene)
+                return;
+            if (!tile_culling) {
+                for (int index = 0; index < scene->primitive_count(); index++)
+                    all_primitives.push_back(index);
+                return;
+            }
+
+            tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            tile_candidates.resize(size_t(tiles_x) * tiles_y);
+
+            // Object bounds in the camera frame: x along u, y along v and depth along -w.
+            struct camera_bounds {
+                interval x, y, depth;
+                bool bounded;
+            };
+            std::vector<camera_bounds> bounds;
+            std::vector<int> primitives;
+            for (int index = 0; index < scene->primitive_count(); index++) {
+                auto box = scene->primitive_bounding_box(index, frame_time, frame_time + std::fmax(0.0, shutter_speed));
+                if (box.is_empty())
+                    continue;
+                camera_bounds b = { interval::empty, interval::empty, interval::empty, box.is_bounded() };
+                if (b.bounded) {
+                    for (int corner = 0; corner < 8; corner++) {
+                        auto p = point3(corner & 1 ? box.x.max : box.x.min,
+                                        corner & 2 ? box.y.max : box.y.min,
+                                        corner & 4 ? box.z.max : box.z.min) - centre;
+                        b.x = interval(b.x, interval(dot(p, u), dot(p, u)));
+                        b.y = interval(b.y, interval(dot(p, v), dot(p, v)));
+                        b.depth = interval(b.depth, interval(-dot(p, w), -dot(p, w)));
+                    }
+                }
+                bounds.push_back(b);
+                primitives.push_back(index);
+            }
+
+            auto aperture = defocus_angle > 0 ? defocus_disk_u.length() : 0.0;
+            for (int tile_j = 0; tile_j < tiles_y; tile_j++) {
+                for (int tile_i = 0; tile_i < tiles_x; tile_i++) {
+                    // Pixel samples are jittered by up to half a pixel around the pixel centres.
+                    auto i0 = tile_i * tile_size - 0.5, i1 = std::min((tile_i + 1) * tile_size, image_width) - 0.5;
+                    auto j0 = tile_j * tile_size - 0.5, j1 = std::min((tile_j + 1) * tile_size, image_height) - 0.5;
+                    auto corner0 = pixel00_loc + i0 * pixel_delta_u + j0 * pixel_delta_v - centre;
+                    auto corner1 = pixel00_loc + i1 * pixel_delta_u + j1 * pixel_delta_v - centre;
+                    auto focus_x = interval(interval(dot(corner0, u), dot(corner0, u)), interval(dot(corner1, u), dot(corner1, u)));
+                    auto focus_y = interval(interval(dot(corner0, v), dot(corner0, v)), interval(dot(corner1, v), dot(corner1, v)));
+
+                    auto& candidates = tile_candidates[size_t(tile_j) * tiles_x + tile_i];
+                    for (size_t k = 0; k < primitives.size(); k++) {
+                        const auto& b = bounds[k];
+                        if (!b.bounded || (frustum_overlaps(focus_x, b.x, b.depth, aperture)
+                                           && frustum_overlaps(focus_y, b.y, b.depth, aperture)))
+                            candidates.push_back(primitives[k]);
+                    }
+                }
+            }
+        }
+
+        bool frustum_overlaps(const interval& focus, const interval& extent, const interval& depth, double aperture) const {
+            // Conservative test along one camera axis. A ray through the focus plane at f from the
+            // lens point o crosses depth d at o + (f - o)*d/focus_dist, so the frustum spans
+            // focus*d/focus_dist widened by aperture*|1 - d/focus_dist| there. Its lower edge is
+            // concave and its upper edge convex in d, so both extremes over the object's depth
+            // range are found at the ends of that range.
+            if (depth.max <= 0)
+                return false;
+            auto d0 = std::fmax(depth.min, 0.0), d1 = depth.max;
+            auto lower = [&](double d) { return focus.min * d / focus_dist - aperture * std::fabs(1 - d / focus_dist); };
+            auto upper = [&](double d) { return focus.max * d / focus_dist + aperture * std::fabs(1 - d / focus_dist); };
+            return std::fmin(lower(d0), lower(d1)) <= extent.max && std::fmax(upper(d0), upper(d1)) >= extent.min;
+        }
+
+        void load_reference(int frame) {
+            reference_pixels.clear();
+            convergence.clear();
+            reference_error = {-1, -1};
+            if (reference.empty())
+                return;
+
+            auto filename = frame_filename(reference, frame, ".pfm");
+            int width, height;
+            if (!read_pfm(filename, width, height, reference_pixels)) {
+                std::cerr << "Could not read reference image " << filename << '\n';
+                reference_pixels.clear();
+            } else if (width != image_width || height != image_height) {
+                std::cerr << "Reference image " << filename << " is " << width << "x" << height
+                          << ", expected " << image_width << "x" << image_height << '\n';
+                reference_pixels.clear();
+            }
+        }
+
+        void report_reference_error(int frame, const std::string& name) const {
+            // Logs the final error and writes the error-versus-time curve as CSV. The precision is set
+            // explicitly since earlier progress output changes it.
+            std::clog << "\rFrame " << frame + 1 << " error against reference: RMSE " << std::setprecision(6)
+                      << reference_error.rmse << ", relative MSE " << reference_error.relative_mse
+                      << "          \n";
+
+            std::ofstream file(frame_filename(name, frame, "_convergence.csv"));
+            file << "seconds,samples_per_pixel,rmse,relative_mse\n";
+            for (const auto& point : convergence) {
+                file << point.seconds << ',' << point.samples << ',' << point.error.rmse << ','
+                     << point.error.relative_mse << '\n';
+            }
+        }
+
+        template <bool thin_lens, bool motion_blur>
+        void render_samples(const hittable& world, colour** pixel_data, int frame, double frame_time,
+                            std::chrono::steady_clock::time_point frame_start) {
+            primary_rays = 0;
+            primary_seconds = 0;
+            guide.reset();
+            if (guiding_training_passes > 0)
+                guide = make_shared<guiding_cache>(guiding_cell_size);
+
+            if (frame_budget > 0) {
+                render_to_deadline<thin_lens, motion_blur>(world, pixel_data, frame, frame_time, frame_start);
+                return;
+            }
+            expected_samples = samples_per_pixel;
+
+            train_guiding<thin_lens, motion_blur>(world, frame, frame_time);
+
+            for (int j = 0; j < image_height; j += rows_per_block()) {
+                TRACE_SCOPE_ARG("scanline", "row", j);
+                std::clog << "\rFrame " << frame + 1 << "/" << total_frames 
+                        << " scanlines remaining: " << (image_height - j) << ' ' << std::flush;
+                int rows_end = std::min(j + rows_per_block(), image_height);
+                for (int sample = 0; sample < samples_per_pixel; sample++) {
+                    trace_rows<thin_lens, motion_blur>(j, rows_end, world, frame_time, [&](int i, int row, const colour& c) {
+                        pixel_data[row][i] += c;
+                    });
+                }
+                for (int row = j; row < rows_end; row++) {
+                    for (int i = 0; i < image_width; i++)
+                        pixel_data[row][i] *= pixel_samples_scale;
+                }
+            }
+            samples_reached = samples_per_pixel;
+            error_estimate = -1;
+        }
+
+        template <bool thin_lens, bool motion_blur>
+        void train_guiding(const hittable& world, int frame, double frame_time) {
+            // Learns the guiding cache from unguided passes over the image, then freezes it for the
+            // rest of the frame. With a fixed sample count these passes are not used in the image;
+            // in budget mode the first passes of the frame train the cache instead.
+            if (!guide)
+                return;
+
+            TRACE_SCOPE("train guiding");
+            for (int pass = 0; pass < guiding_training_passes; pass++) {
+                std::clog << "\rFrame " << frame + 1 << "/" << total_frames << " training guiding cache, pass "
+                          << pass + 1 << "/" << guiding_training_passes << ' ' << std::flush;
+                for (int j = 0; j < image_height; j += rows_per_block()) {
+                    int rows_end = std::min(j + rows_per_block(), image_height);
+                    trace_rows<thin_lens, motion_blur>(j, rows_end, world, frame_time, [](int, int, const colour&) {});
+                }
+            }
+            guide->freeze();
+        }
+
+        template <bool thin_lens, bool motion_blur>
+        void render_to_deadline(const hittable& world, colour** pixel_data, int frame, double frame_time,
+                                std::chrono::steady_clock::time_point frame_start) {
+            // Render progressively, one sample per pixel per pass, for as long as the measured pass
+            // time says another pass still fits within the frame budget. At least one pass is always
+            // taken. The per-pixel luminance moments give a standard error estimate for the result.
+            std::vector<double> luminance_sum(image_width * image_height, 0.0);
+            std::vector<double> luminance_sum_sq(image_width * image_height, 0.0);
+
+            double setup_time = seconds_since(frame_start);
+            double elapsed = setup_time;
+            int passes = 0;
+            expected_samples = 1; // Unknown until a pass has been timed
+
+            while (true) {
+                TRACE_SCOPE_ARG("pass", "pass", passes + 1);
+                for (int j = 0; j < image_height; j += rows_per_block()) {
+                    TRACE_SCOPE_ARG("scanline", "row", j);
+                    int rows_end = std::min(j + rows_per_block(), image_height);
+                    trace_rows<thin_lens, motion_blur>(j, rows_end, world, frame_time, [&](int i, int row, const colour& c) {
+                        pixel_data[row][i] += c;
+
+                        double y = luminance(c);
+                        luminance_sum[row * image_width + i] += y;
+                        luminance_sum_sq[row * image_width + i] += y * y;
+                    });
+                }
+                passes++;
+
+                // Once enough passes have trained the guiding cache, later passes are guided by it.
+                if (guide && !guide->is_frozen() && passes >= guiding_training_passes)
+                    guide->freeze();
+
+                elapsed = seconds_since(frame_start);
+                if (!reference_pixels.empty()) {
+                    auto error = compare_to_reference(pixel_data, 1.0 / passes, reference_pixels, image_width, image_height);
+                    convergence.push_back({elapsed, passes, error});
+                }
+
+                double pass_time = (elapsed - setup_time) / passes;
+                std::clog << "\rFrame " << frame + 1 << "/" << total_frames << " passes: " << passes
+                          << " time remaining: " << std::fixed << std::setprecision(2)
+                          << std::fmax(0.0, frame_budget - elapsed) << "s " << std::defaultfloat << std::setprecision(6) << std::flush;
+                if (elapsed + pass_time > frame_budget)
+                    break;
+
+                // Passes that fit in the remaining budget, if the pass time holds.
+                expected_samples = passes + std::max(1, int((frame_budget - elapsed) / pass_time));
+            }
+
+            double scale = 1.0 / passes;
+            for (int j = 0; j < image_height; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    pixel_data[j][i] *= scale;
+                }
+            }
+
+            // The variance of each pixel mean is the sample variance over the number of samples;
+            // the frame error is the root of its average over the image.
+            double error = -1;
+            if (passes > 1) {
+                double variance_sum = 0;
+                for (size_t k = 0; k < luminance_sum.size(); k++) {
+                    double mean = luminance_sum[k] * scale;
+                    double sample_variance = (luminance_sum_sq[k] * scale - mean * mean) * passes / (passes - 1);
+                    variance_sum += std::fmax(0.0, sample_variance) * scale;
+                }
+                error = std::sqrt(variance_sum / luminance_sum.size());
+            }
+
+            samples_reached = passes;
+            error_estimate = error;
+
+            std::clog << "\rFrame " << frame + 1 << " reached " << passes << " spp in " << std::fixed
+                      << std::setprecision(2) << elapsed << "s, estimated RMS error: ";
+            if (error < 0)
+                std::clog << "n/a";
+            else
+                std::clog << std::setprecision(5) << error;
+            std::clog << std::defaultfloat << std::setprecision(6) << "          \n";
+        }
+
+        static double seconds_since(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        template <bool thin_lens, bool motion_blur>
         ray get_ray(int i, int j, double frame_time) const {
             // Construct a camera ray originating from the defocus disk and directed at randomly
-            // sampled point around the pixel location i, j.
+            // sampled point around the pixel location i, j. A pinhole camera (no thin lens) always
+            // shoots from the centre, and without motion blur every ray is taken at frame_time.
 
             auto offset = sample_square();
             auto pixel_sample = pixel00_loc
                               + ((i + offset.x()) * pixel_delta_u)
                               + ((j + offset.y()) * pixel_delta_v);
             
-            auto ray_origin = (defocus_angle <= 0) ? centre : defocus_disk_sample();
+            auto ray_origin = thin_lens ? defocus_disk_sample() : centre;
             auto ray_direction = pixel_sample - ray_origin;
             
             // Generate ray time within shutter interval
-            double ray_time = frame_time + random_double() * shutter_speed;
+            double ray_time = motion_blur ? frame_time + random_double() * shutter_speed : frame_time;
 
             return ray(ray_origin, ray_direction, ray_time);
         }
@@ -132,25 +495,250 @@ class camera {
             return centre + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        colour ray_colour(const ray& r, int depth, const hittable&  world) const {
+        bool packet_tracing() const {
+            // Packets are only traced through a collection of primitives, and must fit within a culling tile.
+            return (packet_size == 2 || packet_size == 4 || packet_size == 8) && scene_objects;
+        }
+
+        int rows_per_block() const {
+            return packet_tracing() ? packet_size : 1;
+        }
+
+        const std::vector<int>& tile_primitives(int i, int j) const {
+            // The primitives camera rays through pixel i, j can hit: the tile's candidates, or all
+            // of them when not culling. Only valid if the world is a hittable_collection.
+            if (tile_candidates.empty())
+                return all_primitives;
+            return tile_candidates[size_t(j / tile_size) * tiles_x + i / tile_size];
+        }
+
+        template <bool thin_lens, bool motion_blur, typename F>
+        void trace_rows(int j0, int j1, const hittable& world, double frame_time, F accumulate) {
+            // Takes one sample through every pixel of rows j0 to j1 (exclusive) and passes each
+            // pixel's colour to accumulate(i, j, colour). The camera rays are generated first, then
+            // their first hits are found, which is timed as primary visibility, and then they are
+            // shaded. Everything after the first hit is traced one ray at a time.
+            size_t ray_count = size_t(j1 - j0) * image_width;
+            camera_rays.resize(ray_count);
+            camera_hits.resize(ray_count);
+            camera_hit_found.resize(ray_count);
+            for (int j = j0; j < j1; j++) {
+                for (int i = 0; i < image_width; i++)
+                    camera_rays[size_t(j - j0) * image_width + i] = get_ray<thin_lens, motion_blur>(i, j, frame_time);
+            }
+
+            auto visibility_start = std::chrono::steady_clock::now();
+            if (packet_tracing())
+                find_first_hits_in_packets(j0, j1);
+            else
+                find_first_hits(j0, j1, world);
+            primary_seconds += seconds_since(visibility_start);
+            primary_rays += (long long)ray_count;
+
+            for (int j = j0; j < j1; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    auto k = size_t(j - j0) * image_width + i;
+                    if (max_depth <= 0)
+                        accumulate(i, j, colour(0,0,0));
+                    else if (camera_hit_found[k])
+                        accumulate(i, j, surface_colour(camera_rays[k], camera_hits[k], max_depth, world, 0));
+                    else
+                        accumulate(i, j, escaped_colour(camera_rays[k], 0));
+                }
+            }
+        }
+
+        void find_first_hits(int j0, int j1, const hittable& world) {
+            for (int j = j0; j < j1; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    auto k = size_t(j - j0) * image_width + i;
+                    camera_hit_found[k] = scene_objects
+                        ? scene_objects->hit_primitives(tile_primitives(i, j), camera_rays[k], interval(0.001, infinity), camera_hits[k])
+                        : world.hit(camera_rays[k], interval(0.001, infinity), camera_hits[k]);
+                }
+            }
+        }
+
+        void find_first_hits_in_packets(int j0, int j1) {
+            // Each packet covers a block of packet_size x packet_size pixels, which lies within one
+            // culling tile. Objects the whole packet misses are rejected after a single pass over
+            // its rays; hit records are then only built for the closest object along each ray.
+            ray_packet packet;
+            size_t lanes[ray_packet::max_size];
+            for (int i0 = 0; i0 < image_width; i0 += packet_size) {
+                int i1 = std::min(i0 + packet_size, image_width);
+                packet.clear();
+                for (int j = j0; j < j1; j++) {
+                    for (int i = i0; i < i1; i++) {
+                        lanes[packet.count] = size_t(j - j0) * image_width + i;
+                        packet.add(camera_rays[lanes[packet.count]]);
+                    }
+                }
+
+                bool hit_anything = scene_objects->closest_hits(tile_primitives(i0, j0), packet);
+                for (int lane = 0; lane < packet.count; lane++) {
+                    auto k = lanes[lane];
+                    camera_hit_found[k] = hit_anything && packet.object[lane] >= 0
+                        && scene_objects->hit_primitive(packet.object[lane], camera_rays[k], interval(packet.t_min, infinity), camera_hits[k]);
+                }
+            }
+        }
+
+        colour ray_colour(const ray& r, int depth, const hittable& world, double scattering_pdf = 0) const {
+            // `scattering_pdf` is the density with which the previous diffuse bounce chose this
+            // ray, or zero for camera rays and specular bounces.
+
             // If we've exceeded the ray bounce limit, no more light is gathered.
             if (depth <= 0)
                 return colour(0,0,0);
             
             hit_record rec;
+            if (world.hit(r, interval(0.001, infinity), rec))
+                return surface_colour(r, rec, depth, world, scattering_pdf);
+            return escaped_colour(r, scattering_pdf);
+        }
 
-            if (world.hit(r, interval(0.001, infinity), rec)) {
-                ray scattered;
-                colour attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered))
-                    return attenuation * ray_colour(scattered, depth-1, world);
-                return colour(0,0,0);
+        colour surface_colour(const ray& r, const hit_record& rec, int depth, const hittable& world,
+                              double scattering_pdf) const {
+            // Light leaving the hit `rec` back along `r`.
+
+            // Emission found by a scattered ray is weighted against the chance that light
+            // sampling at the previous bounce would have found it instead.
+            colour colour_from_emission = rec.mat->emitted(r, rec);
+            if (scattering_pdf > 0 && sample_lights())
+                colour_from_emission *= power_heuristic(scattering_pdf, light_pdf(r.origin(), r.direction(), r.time()));
+
+            colour colour_from_lights(0,0,0);
+            if (sample_lights())
+                colour_from_lights = sample_direct_light(r, rec, world);
+
+            ray scattered;
+            colour attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return colour_from_emission + colour_from_lights;
+
+            auto next_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+            auto cell = (next_pdf > 0) ? guide_cell(rec) : nullptr;
+            if (cell) {
+                // Guided bounce: sample from a mixture of the cache and the BSDF. The material's
+                // attenuation assumes its own sampling density, so it is rescaled to the mixture.
+                if (random_double() < guiding_fraction)
+                    scattered = ray(rec.p, cell->sample(), r.time());
+                auto bsdf_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+                if (bsdf_pdf <= 0)
+                    return colour_from_emission + colour_from_lights;
+                next_pdf = guided_pdf(cell, bsdf_pdf, scattered.direction());
+                attenuation = attenuation * (bsdf_pdf / next_pdf);
             }
 
-            vec3 unit_direction = unit_vector(r.direction());
+            colour incoming = ray_colour(scattered, depth-1, world, next_pdf);
+            if (next_pdf > 0 && guide && !guide->is_frozen())
+                guide->record(rec.p, scattered.direction(), luminance(incoming) / next_pdf);
+
+            return colour_from_emission + colour_from_lights + attenuation * incoming;
+        }
+
+        colour escaped_colour(const ray& r, double scattering_pdf) const {
+            // Light arriving along `r` from beyond the scene.
+            colour colour_from_background = background_colour(r.direction(), scattering_pdf);
+            if (scattering_pdf > 0 && sample_lights())
+                colour_from_background *= power_heuristic(scattering_pdf, light_pdf(r.origin(), r.direction(), r.time()));
+            return colour_from_background;
+        }
+
+        colour background_colour(const vec3& direction, double scattering_pdf) const {
+            if (environment)
+                return environment->radiance(direction, environment_footprint(scattering_pdf));
+
+            if (!sky)
+                return background;
+
+            vec3 unit_direction = unit_vector(direction);
             auto a = 0.5*(unit_direction.y() + 1.0);
             return (1.0-a)*colour(1.0, 1.0, 1.0) + a*colour(0.5, 0.7, 1.0);
         }
+
+        double environment_footprint(double scattering_pdf) const {
+            // Without light sampling, rays leaving a diffuse bounce each stand for roughly
+            // 1/(pdf * spp) steradians, so they read a prefiltered environment: a little blur in
+            // indirect lighting for much less noise. spp is the sample count the frame is expected
+            // to reach, which in budget mode is projected from the pass time after every pass.
+            // When the environment is importance sampled, filtering would spread bright texels away
+            // from where the sampling tables point, so lookups stay exact. Camera and specular rays
+            // always read it unfiltered.
+            if (light_sampling || scattering_pdf <= 0)
+                return 0;
+            return 1.0 / (scattering_pdf * expected_samples);
+        }
+
+        const directional_histogram* guide_cell(const hit_record& rec) const {
+            // The guiding histogram for a diffuse hit, once the cache has finished training.
+            return guide ? guide->find(rec.p) : nullptr;
+        }
+
+        double guided_pdf(const directional_histogram* cell, double bsdf_pdf, const vec3& direction) const {
+            return guiding_fraction * cell->pdf_value(direction) + (1 - guiding_fraction) * bsdf_pdf;
+        }
+
+        bool has_area_lights() const {
+            return lights != nullptr && !lights->objects.empty();
+        }
+
+        bool sample_lights() const {
+            return light_sampling && (has_area_lights() || environment);
+        }
+
+        double environment_selection_probability() const {
+            // Light samples are split evenly between the area lights and the environment.
+            if (!environment)
+                return 0;
+            return has_area_lights() ? 0.5 : 1;
+        }
+
+        double light_pdf(const point3& origin, const vec3& direction, double time) const {
+            // Solid angle density of `direction` under the mixture of light sampling strategies.
+            auto environment_probability = environment_selection_probability();
+            auto pdf = 0.0;
+            if (environment_probability < 1)
+                pdf += (1 - environment_probability) * lights->pdf_value(origin, direction, time);
+            if (environment_probability > 0)
+                pdf += environment_probability * environment->pdf_value(direction);
+            return pdf;
+        }
+
+        colour sample_direct_light(const ray& r_in, const hit_record& rec, const hittable& world) const {
+            // Next-event estimation: connect the hit point to a random point on a light, weighted
+            // against the chance that scattering would have produced the same direction.
+            auto direction = (random_double() < environment_selection_probability())
+                           ? environment->random()
+                           : lights->random(rec.p, r_in.time());
+            auto pdf = light_pdf(rec.p, direction, r_in.time());
+            if (pdf <= 0)
+                return colour(0,0,0);
+
+            ray shadow_ray(rec.p, direction, r_in.time());
+            colour f = rec.mat->evaluate(r_in, rec, shadow_ray);
+            if (f.near_zero())
+                return colour(0,0,0);
+
+            // The nearest hit along the shadow ray is either a light or an occluder. Rays that
+            // escape the scene see the environment, if there is one.
+            auto scattering_pdf = rec.mat->scattering_pdf(r_in, rec, shadow_ray);
+            auto cell = guide_cell(rec);
+            if (cell)
+                scattering_pdf = guided_pdf(cell, scattering_pdf, direction);
+            colour incoming;
+            hit_record light_rec;
+            if (world.hit(shadow_ray, interval(0.001, infinity), light_rec))
+                incoming = light_rec.mat->emitted(shadow_ray, light_rec);
+            else if (environment)
+                incoming = environment->radiance(direction, environment_footprint(scattering_pdf));
+            else
+                return colour(0,0,0);
+
+            auto weight = power_heuristic(pdf, scattering_pdf) / pdf;
+            return weight * f * incoming;
+        }
 };
 
 #endif
\ No newline at end of file
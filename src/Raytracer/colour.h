@@ -14,6 +14,11 @@ inline double linear_to_gamma(double linear_component)
     return 0;
 }
 
+inline double luminance(const colour& c) {
+    // Relative luminance of a linear (Rec. 709) colour.
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 void write_colour(unsigned char* image, int base_index, const colour& pixel_colour) {
     auto r = pixel_colour.x();
     auto g = pixel_colour.y();
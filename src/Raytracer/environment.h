@@ -0,0 +1,207 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "pfm.h"
+#include "rgbe.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+// Distant lighting from a latitude-longitude HDR image. The map is importance sampled in proportion
+// to its luminance using a marginal CDF over rows and a conditional CDF within each row, and looked
+// up through a box-filtered mip pyramid so that wide ray footprints see prefiltered radiance.
+//
+// Direction mapping: +y is up. Row v runs from the zenith (v = 0) to the nadir (v = 1), and column
+// u wraps once around the vertical axis, starting at -x.
+class environment_light {
+    public:
+        environment_light(const std::string& filename, double intensity = 1.0) {
+            auto start = std::chrono::steady_clock::now();
+
+            int width, height;
+            std::vector<colour> pixels;
+            bool is_pfm = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0;
+            bool loaded = is_pfm ? read_pfm(filename, width, height, pixels)
+                                 : read_rgbe(filename, width, height, pixels);
+            if (!loaded) {
+                std::cerr << "Could not read environment map " << filename << '\n';
+                return;
+            }
+            for (auto& pixel : pixels)
+                pixel *= intensity;
+
+            auto loaded_time = std::chrono::steady_clock::now();
+            build_mip_levels(width, height, pixels);
+            build_sampling_tables();
+            auto built_time = std::chrono::steady_clock::now();
+
+            std::clog << "Environment map " << filename << ": " << width << "x" << height << ", loaded in "
+                      << std::chrono::duration<double, std::milli>(loaded_time - start).count()
+                      << " ms, " << levels.size() << " mip levels and sampling tables built in "
+                      << std::chrono::duration<double, std::milli>(built_time - loaded_time).count() << " ms\n";
+        }
+
+        bool valid() const { return !levels.empty(); }
+
+        colour radiance(const vec3& direction, double footprint = 0) const {
+            // Radiance arriving from `direction`. `footprint` is the solid angle the lookup should
+            // cover; the mip level whose texels are about that size is used, blended with the next.
+            auto uv = direction_to_uv(direction);
+
+            auto level = 0.0;
+            if (footprint > 0) {
+                auto texel_solid_angle = 4*pi / (level_width(0) * double(level_height(0)));
+                level = clamp(0.5 * std::log2(footprint / texel_solid_angle), 0.0, levels.size() - 1.0);
+            }
+
+            int fine = int(level);
+            int coarse = std::min(fine + 1, int(levels.size()) - 1);
+            auto t = level - fine;
+
+            colour result = bilinear(fine, uv.x(), uv.y());
+            if (t > 0)
+                result = (1 - t) * result + t * bilinear(coarse, uv.x(), uv.y());
+            return result;
+        }
+
+        // Solid angle density with which random() produces `direction`.
+        double pdf_value(const vec3& direction) const {
+            auto uv = direction_to_uv(direction);
+            auto sin_theta = std::sin(pi * uv.y());
+            if (sin_theta <= 0)
+                return 0;
+
+            int width = level_width(0), height = level_height(0);
+            int i = std::min(int(uv.x() * width), width - 1);
+            int j = std::min(int(uv.y() * height), height - 1);
+
+            // Density over the unit square, converted to solid angle: dw = 2 pi^2 sin(theta) du dv.
+            auto pdf_uv = texel_probability(i, j) * width * height;
+            return pdf_uv / (2*pi*pi * sin_theta);
+        }
+
+        vec3 random() const {
+            int width = level_width(0), height = level_height(0);
+
+            // Pick a row from the marginal distribution, then a column within that row.
+            auto r1 = random_double();
+            int j = int(std::upper_bound(marginal_cdf.begin() + 1, marginal_cdf.end(), r1) - marginal_cdf.begin()) - 1;
+            j = std::min(j, height - 1);
+            auto row_probability = marginal_cdf[j + 1] - marginal_cdf[j];
+            auto dv = row_probability > 0 ? (r1 - marginal_cdf[j]) / row_probability : 0.5;
+
+            auto row = conditional_cdf.begin() + size_t(j) * (width + 1);
+            auto r2 = random_double();
+            int i = int(std::upper_bound(row + 1, row + width + 1, r2) - row) - 1;
+            i = std::min(i, width - 1);
+            auto column_probability = row[i + 1] - row[i];
+            auto du = column_probability > 0 ? (r2 - row[i]) / column_probability : 0.5;
+
+            return uv_to_direction((i + du) / width, (j + dv) / height);
+        }
+
+    private:
+        std::vector<std::vector<colour>> levels; // Mip pyramid, full resolution first
+        std::vector<int> widths, heights;        // Dimensions of each mip level
+        std::vector<double> marginal_cdf;        // Row CDF, height + 1 entries
+        std::vector<double> conditional_cdf;     // Per-row column CDFs, (width + 1) entries per row
+
+        int level_width(int level) const { return widths[level]; }
+        int level_height(int level) const { return heights[level]; }
+
+        void build_mip_levels(int width, int height, std::vector<colour>& pixels) {
+            // Each level averages 2x2 texels of the one above it, down to a single texel.
+            levels.push_back(std::move(pixels));
+            widths.push_back(width);
+            heights.push_back(height);
+
+            while (width > 1 || height > 1) {
+                int next_width = std::max(1, width / 2);
+                int next_height = std::max(1, height / 2);
+                const auto& source = levels.back();
+                std::vector<colour> next(size_t(next_width) * next_height);
+
+                for (int j = 0; j < next_height; j++) {
+                    int j0 = std::min(2*j, height - 1), j1 = std::min(2*j + 1, height - 1);
+                    for (int i = 0; i < next_width; i++) {
+                        int i0 = std::min(2*i, width - 1), i1 = std::min(2*i + 1, width - 1);
+                        next[size_t(j) * next_width + i] = 0.25 * (
+                            source[size_t(j0) * width + i0] + source[size_t(j0) * width + i1] +
+                            source[size_t(j1) * width + i0] + source[size_t(j1) * width + i1]);
+                    }
+                }
+
+                levels.push_back(std::move(next));
+                widths.push_back(width = next_width);
+                heights.push_back(height = next_height);
+            }
+        }
+
+        void build_sampling_tables() {
+            // Texels are weighted by luminance and by sin(theta), the solid angle each row covers.
+            int width = level_width(0), height = level_height(0);
+            const auto& pixels = levels[0];
+
+            marginal_cdf.assign(height + 1, 0.0);
+            conditional_cdf.assign(size_t(height) * (width + 1), 0.0);
+
+            for (int j = 0; j < height; j++) {
+                auto sin_theta = std::sin(pi * (j + 0.5) / height);
+                double* row = &conditional_cdf[size_t(j) * (width + 1)];
+                for (int i = 0; i < width; i++)
+                    row[i + 1] = row[i] + std::fmax(0.0, luminance(pixels[size_t(j) * width + i])) * sin_theta;
+
+                auto row_total = row[width];
+                for (int i = 1; i <= width; i++)
+                    row[i] = (row_total > 0) ? row[i] / row_total : double(i) / width;
+                marginal_cdf[j + 1] = marginal_cdf[j] + row_total;
+            }
+
+            auto total = marginal_cdf[height];
+            for (int j = 1; j <= height; j++)
+                marginal_cdf[j] = (total > 0) ? marginal_cdf[j] / total : double(j) / height;
+        }
+
+        double texel_probability(int i, int j) const {
+            const double* row = &conditional_cdf[size_t(j) * (level_width(0) + 1)];
+            return (marginal_cdf[j + 1] - marginal_cdf[j]) * (row[i + 1] - row[i]);
+        }
+
+        colour bilinear(int level, double u, double v) const {
+            // Filtered lookup between texel centres, wrapping around in u and clamped in v.
+            int width = level_width(level), height = level_height(level);
+            const auto& pixels = levels[level];
+
+            auto x = u * width - 0.5;
+            auto y = v * height - 0.5;
+            int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+            auto tx = x - x0, ty = y - y0;
+
+            auto texel = [&](int i, int j) -> const colour& {
+                i = ((i % width) + width) % width;
+                j = std::min(std::max(j, 0), height - 1);
+                return pixels[size_t(j) * width + i];
+            };
+
+            return (1 - ty) * ((1 - tx) * texel(x0, y0)     + tx * texel(x0 + 1, y0))
+                 +      ty  * ((1 - tx) * texel(x0, y0 + 1) + tx * texel(x0 + 1, y0 + 1));
+        }
+
+        static vec3 direction_to_uv(const vec3& direction) {
+            // Returns (u, v, 0), both in [0,1).
+            auto d = unit_vector(direction);
+            auto theta = std::acos(clamp(d.y(), -1.0, 1.0));
+            auto phi = std::atan2(d.z(), d.x()) + pi;
+            return vec3(std::fmin(phi / (2*pi), 0.999999), std::fmin(theta / pi, 0.999999), 0);
+        }
+
+        static vec3 uv_to_direction(double u, double v) {
+            auto theta = pi * v;
+            auto phi = 2*pi*u - pi;
+            return vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+        }
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Path guiding cache: a learned estimate of where incident light comes from, used to steer
+// diffuse bounces towards it. Space is divided into a hashed uniform grid of cells, each holding
+// a directional histogram over the sphere. Histograms are filled while training and then frozen,
+// after which the cache is only read, so it can be shared between rendering threads.
+//
+// Directions are binned with the equal-area cylindrical mapping (y, phi), so every bin covers the
+// same solid angle and sampling within a bin is uniform.
+class directional_histogram {
+    public:
+        static const int cos_bins = 16;
+        static const int phi_bins = 32;
+        static const int bin_count = cos_bins * phi_bins;
+
+        directional_histogram() : weights(bin_count, 0.0f) {}
+
+        void record(const vec3& direction, double weight) {
+            weights[bin_index(direction)] += float(weight);
+        }
+
+        // Converts the recorded weights into a sampling distribution. Returns false if nothing
+        // useful was recorded, in which case the histogram should not be sampled.
+        bool build() {
+            cdf.assign(bin_count + 1, 0.0f);
+            for (int bin = 0; bin < bin_count; bin++)
+                cdf[bin + 1] = cdf[bin] + weights[bin];
+
+            auto total = cdf[bin_count];
+            if (!(total > 0))
+                return false;
+            for (auto& value : cdf)
+                value /= total;
+            cdf[bin_count] = 1.0f; // Guard against rounding, so that sample() never runs off the end
+            return true;
+        }
+
+        // Solid angle density with which sample() produces `direction`.
+        double pdf_value(const vec3& direction) const {
+            int bin = bin_index(direction);
+            return (cdf[bin + 1] - cdf[bin]) * bin_count / (4*pi);
+        }
+
+        vec3 sample() const {
+            auto r = float(random_double());
+            int bin = int(std::upper_bound(cdf.begin() + 1, cdf.end(), r) - cdf.begin()) - 1;
+            bin = std::min(std::max(bin, 0), bin_count - 1);
+
+            // Uniform within the bin, which is uniform in solid angle under this mapping.
+            auto y = -1 + 2 * ((bin / phi_bins) + random_double()) / cos_bins;
+            auto phi = 2*pi * ((bin % phi_bins) + random_double()) / phi_bins;
+            auto r_xz = std::sqrt(std::fmax(0.0, 1 - y*y));
+            return vec3(r_xz * std::cos(phi), y, r_xz * std::sin(phi));
+        }
+
+    private:
+        std::vector<float> weights;
+        std::vector<float> cdf;
+
+        static int bin_index(const vec3& direction) {
+            auto d = unit_vector(direction);
+            auto phi = std::atan2(d.z(), d.x());
+            if (phi < 0)
+                phi += 2*pi;
+            int i = std::min(int((d.y() + 1) * 0.5 * cos_bins), cos_bins - 1);
+            int j = std::min(int(phi / (2*pi) * phi_bins), phi_bins - 1);
+            return std::max(i, 0) * phi_bins + std::max(j, 0);
+        }
+};
+
+class guiding_cache {
+    public:
+        guiding_cache(double cell_size) : cell_size(cell_size) {}
+
+        // Training: adds a sample of incident radiance arriving at `p` from `direction`. `weight`
+        // should be the radiance luminance divided by the density the direction was sampled with.
+        void record(const point3& p, const vec3& direction, double weight) {
+            if (weight > 0 && weight < infinity)
+                cells[cell_key(p)].record(direction, weight);
+        }
+
+        // Ends training; empty cells are dropped so that lookups there fall back to BSDF sampling.
+        void freeze() {
+            for (auto it = cells.begin(); it != cells.end();) {
+                if (it->second.build())
+                    ++it;
+                else
+                    it = cells.erase(it);
+            }
+            frozen = true;
+        }
+
+        bool is_frozen() const { return frozen; }
+
+        // The histogram for the cell containing `p`, or nullptr if there is none or the cache is
+        // still training.
+        const directional_histogram* find(const point3& p) const {
+            if (!frozen)
+                return nullptr;
+            auto it = cells.find(cell_key(p));
+            return (it == cells.end()) ? nullptr : &it->second;
+        }
+
+    private:
+        double cell_size;
+        bool frozen = false;
+        std::unordered_map<std::uint64_t, directional_histogram> cells;
+
+        std::uint64_t cell_key(const point3& p) const {
+            // Packs the cell coordinates into 21 bits each; distant cells may share a key, which
+            // only merges their statistics.
+            std::uint64_t key = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                auto coordinate = std::int64_t(std::floor(p[axis] / cell_size));
+                key = (key << 21) | (std::uint64_t(coordinate) & 0x1fffff);
+            }
+            return key;
+        }
+};
+
+#endif
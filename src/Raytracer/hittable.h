@@ -1,6 +1,10 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "packet.h"
+
+#include <vector>
+
 class material;
 
 class hit_record {
@@ -29,6 +33,60 @@ class hittable {
         // for this function. Takes a ray object, min and max parameter values for the ray, and a reference to 
         // hit record.
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+        // Finds where the packet's rays hit the object closer than their current t_max, and for those
+        // rays records the new distance and `id` as the closest object. Returns whether any ray hit.
+        // Objects without a vectorised test fall back to testing the rays one at a time.
+        virtual bool hit_packet(ray_packet& packet, int id) const {
+            bool hit_any = false;
+            hit_record rec;
+            for (int k = 0; k < packet.count; k++) {
+                if (hit(packet.get(k), interval(packet.t_min, packet.t_max[k]), rec)) {
+                    packet.t_max[k] = rec.t;
+                    packet.object[k] = id;
+                    hit_any = true;
+                }
+            }
+            return hit_any;
+        }
+
+        // Box enclosing the object at every moment between time0 and time1. Objects that do not
+        // override this are treated as unbounded, so they are never culled.
+        virtual aabb bounding_box(double time0, double time1) const {
+            return aabb::universe;
+        }
+
+        // Solid angle density with which random() produces `direction` from `origin` at the given
+        // time. Only objects that can be sampled as lights need to override these two functions.
+        virtual double pdf_value(const point3& origin, const vec3& direction, double time) const {
+            return 0.0;
+        }
+
+        // Returns a direction from `origin` towards a random point on the object.
+        virtual vec3 random(const point3& origin, double time) const {
+            return vec3(1,0,0);
+        }
+};
+
+// A hittable made of primitives addressed by index, such as the objects of a hittable_list or the
+// flat sphere array of a scene cache. The camera culls camera rays against the primitives' bounds
+// and traces each tile against only the indices it kept.
+class hittable_collection : public hittable {
+    public:
+        virtual int primitive_count() const = 0;
+
+        // Box enclosing primitive `index` at every moment between time0 and time1.
+        virtual aabb primitive_bounding_box(int index, double time0, double time1) const = 0;
+
+        // Closest hit among the primitives listed in `indices`.
+        virtual bool hit_primitives(const std::vector<int>& indices, const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+        // Finds the closest of the primitives listed in `indices` along each ray of the packet,
+        // leaving its index in packet.object. Returns false if the whole packet missed.
+        virtual bool closest_hits(const std::vector<int>& indices, ray_packet& packet) const = 0;
+
+        // hit() for primitive `index` alone, used to build the hit record for a packet's closest hit.
+        virtual bool hit_primitive(int index, const ray& r, interval ray_t, hit_record& rec) const = 0;
 };
 
 #endif
\ No newline at end of file
@@ -3,9 +3,10 @@
 
 #include "hittable.h"
 
+#include <algorithm>
 #include <vector>
 
-class hittable_list : public hittable {
+class hittable_list : public hittable_collection {
     public:
         std::vector<shared_ptr<hittable>> objects;
 
@@ -36,6 +37,71 @@ class hittable_list : public hittable {
 
             return hit_anything;
         }
+
+        int primitive_count() const override { return int(objects.size()); }
+
+        aabb primitive_bounding_box(int index, double time0, double time1) const override {
+            return objects[index]->bounding_box(time0, time1);
+        }
+
+        bool hit_primitives(const std::vector<int>& indices, const ray& r, interval ray_t, hit_record& rec) const override {
+            hit_record temp_rec;
+            bool hit_anything = false;
+            auto closest_so_far = ray_t.max;
+
+            for (int index : indices) {
+                if (objects[index]->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    rec = temp_rec;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        bool closest_hits(const std::vector<int>& indices, ray_packet& packet) const override {
+            bool hit_anything = false;
+            for (int index : indices) {
+                if (objects[index]->hit_packet(packet, index))
+                    hit_anything = true;
+            }
+            return hit_anything;
+        }
+
+        bool hit_primitive(int index, const ray& r, interval ray_t, hit_record& rec) const override {
+            return objects[index]->hit(r, ray_t, rec);
+        }
+
+        aabb bounding_box(double time0, double time1) const override {
+            aabb bbox = aabb::empty;
+            for (const auto& object : objects)
+                bbox = aabb(bbox, object->bounding_box(time0, time1));
+            return bbox;
+        }
+
+        // Lights are picked uniformly, so the density is the average over all objects.
+        double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+            if (objects.empty())
+                return 0.0;
+
+            auto weight = 1.0 / objects.size();
+            auto sum = 0.0;
+
+            for (const auto& object : objects)
+                sum += weight * object->pdf_value(origin, direction, time);
+
+            return sum;
+        }
+
+        vec3 random(const point3& origin, double time) const override {
+            if (objects.empty())
+                return vec3(1,0,0);
+
+            auto int_size = int(objects.size());
+            auto index = std::min(int(random_double() * int_size), int_size - 1);
+            return objects[index]->random(origin, time);
+        }
 };
 
 #endif
\ No newline at end of file
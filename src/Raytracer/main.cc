@@ -4,15 +4,18 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "scene_cache.h"
 #include "sphere.h"
 
+#include <chrono>
+#include <stdexcept>
+#include <string>
 
-int main(int argc, char* argv[]) {
-    hittable_list world;
-
-    // Camera
-    camera cam;
+// Version of the scene setup code below, stored in scene caches. Increase it whenever a scene
+// function changes, so that caches built by the old code are rebuilt instead of reused.
+const std::uint32_t scene_setup_version = 1;
 
+void bouncing_spheres(hittable_list& world, camera& cam) {
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
     cam.samples_per_pixel = 100;
@@ -70,9 +73,188 @@ int main(int argc, char* argv[]) {
             }
         }
     }
+}
+
+void small_lights(hittable_list& world, hittable_list& lights, camera& cam) {
+    // A dark scene lit only by two small sphere lights, where paths rarely find the light by
+    // scattering alone.
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+
+    cam.vfov     = 20;
+    cam.lookfrom = point3(13,2,3);
+    cam.lookdir  = vec3(-13,-1,-3);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+    cam.focus_dist    = 13.0;
+    cam.shutter_speed = 0;
+    cam.total_frames = 1;
+    cam.fps = 24;
+
+    cam.sky = false;
+    cam.background = colour(0,0,0);
+
+    auto ground_material = make_shared<lambertian>(colour(0.5, 0.5, 0.5), 0.8);
+    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
+
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(colour(0.4, 0.2, 0.1), 0.6)));
+    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0)));
+
+    auto warm_light = make_shared<sphere>(point3(-2, 3.5, 1.5), 0.25, make_shared<diffuse_light>(colour(60, 50, 40)));
+    auto cool_light = make_shared<sphere>(point3(2, 2.5, 2), 0.15, make_shared<diffuse_light>(colour(40, 50, 80)));
+
+    world.add(warm_light);
+    world.add(cool_light);
+    lights.add(warm_light);
+    lights.add(cool_light);
+}
+
+int positive_int(const std::string& value) {
+    // Parses an option value that must be a whole number of at least 1.
+    int number = std::stoi(value);
+    if (number < 1)
+        throw std::invalid_argument(value);
+    return number;
+}
+
+double positive_double(const std::string& value) {
+    // Parses an option value that must be a number greater than 0.
+    double number = std::stod(value);
+    if (!(number > 0))
+        throw std::invalid_argument(value);
+    return number;
+}
+
+int main(int argc, char* argv[]) {
+    hittable_list world;
+    hittable_list lights;
+
+    // Camera
+    camera cam;
+
+    // Optional settings following the output file name, given as key=value pairs. Scene settings
+    // are applied first so that the remaining options can override them.
+    std::string scene = "spheres";
+    std::string scene_cache;
+    unsigned seed = 1;
+    for (int arg = 2; arg < argc; arg++) {
+        std::string option = argv[arg];
+        if (option.compare(0, 6, "scene=") == 0)
+            scene = option.substr(6);
+        else if (option.compare(0, 5, "seed=") == 0) {
+            try {
+                seed = unsigned(std::stoul(option.substr(5)));
+            } catch (const std::logic_error&) {
+                std::cerr << "Ignoring invalid value for seed: " << option.substr(5) << '\n';
+            }
+        }
+        else if (option.compare(0, 12, "scene_cache=") == 0)
+            scene_cache = option.substr(12);
+    }
+    std::srand(seed);
+    if (scene != "spheres" && scene != "lights") {
+        std::cerr << "Unknown scene \"" << scene << "\", rendering spheres instead.\n";
+        scene = "spheres";
+    }
+
+    // A scene cache built for the same scene and seed replaces the scene's setup code, and its
+    // spheres are rendered straight from the file; otherwise the scene is built and, if a cache file
+    // was given, saved to it for later runs.
+    shared_ptr<hittable_collection> cached_world;
+    const hittable_collection* scene_world = &world;
+    {
+        TRACE_SCOPE("scene setup");
+        auto setup_start = std::chrono::steady_clock::now();
+        if (!scene_cache.empty())
+            cached_world = load_scene_cache(scene_cache, scene, seed, scene_setup_version, lights, cam);
+        bool cached = cached_world != nullptr;
+        if (cached)
+            scene_world = cached_world.get();
+        else if (scene == "lights")
+            small_lights(world, lights, cam);
+        else
+            bouncing_spheres(world, cam);
+        auto setup_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - setup_start).count();
 
+        std::clog << "Scene " << scene << " with " << scene_world->primitive_count() << " objects "
+                  << (cached ? "loaded from " + scene_cache : std::string("built")) << " in " << setup_time << " ms\n";
+        if (!cached && !scene_cache.empty() && save_scene_cache(scene_cache, scene, seed, scene_setup_version, world, lights, cam))
+            std::clog << "Scene cache written to " << scene_cache << '\n';
+    }
+
+    // Scene setup draws random numbers only when the scene is built, not when it is loaded from a
+    // cache, so rendering restarts the sequence from a seed derived from the same one.
+    std::srand(seed + 1);
+
+    double tolerance = -1; // Largest relative MSE against the reference accepted for any frame
+    for (int arg = 2; arg < argc; arg++) {
+        std::string option = argv[arg];
+        auto split = option.find('=');
+        std::string key = option.substr(0, split);
+        std::string value = (split == std::string::npos) ? "" : option.substr(split + 1);
+
+        // Values that are not numbers where one is expected are reported and skipped, like unknown keys.
+        try {
+            if (key == "scene" || key == "seed" || key == "scene_cache")
+                continue;
+            else if (key == "budget")
+                cam.frame_budget = std::stod(value);
+            else if (key == "width")
+                cam.image_width = positive_int(value);
+            else if (key == "spp")
+                cam.samples_per_pixel = positive_int(value);
+            else if (key == "frames")
+                cam.total_frames = positive_int(value);
+            else if (key == "defocus")
+                cam.defocus_angle = std::stod(value);
+            else if (key == "shutter")
+                cam.shutter_speed = std::stod(value);
+            else if (key == "light_sampling")
+                cam.light_sampling = (value != "0");
+            else if (key == "environment") {
+                auto environment = make_shared<environment_light>(value);
+                if (environment->valid())
+                    cam.environment = environment;
+            }
+            else if (key == "guiding")
+                cam.guiding_training_passes = std::stoi(value);
+            else if (key == "guiding_cell")
+                cam.guiding_cell_size = positive_double(value);
+            else if (key == "culling")
+                cam.tile_culling = (value != "0");
+            else if (key == "packet")
+                cam.packet_size = std::stoi(value);
+            else if (key == "linear")
+                cam.write_linear = (value != "0");
+            else if (key == "reference")
+                cam.reference = value;
+            else if (key == "tolerance")
+                tolerance = std::stod(value);
+            else
+                std::cerr << "Ignoring unknown option: " << option << '\n';
+        } catch (const std::logic_error&) {
+            std::cerr << "Ignoring invalid value for " << key << ": " << value << '\n';
+        }
+    }
+
+    int failed_frames = 0;
     for (int frame = 0; frame < cam.total_frames; frame++) {
         double frame_time = frame * (1.0 / cam.fps);
-        cam.render(world, argc, argv, frame, frame_time);
+        cam.render(*scene_world, lights, argc, argv, frame, frame_time);
+
+        // A frame fails the quality check if its reference is unusable or its error is too high.
+        auto error = cam.last_reference_error();
+        if (tolerance >= 0 && (error.relative_mse < 0 || error.relative_mse > tolerance)) {
+            std::cerr << "Frame " << frame + 1 << " exceeds the relative MSE tolerance of " << tolerance << '\n';
+            failed_frames++;
+        }
     }
-}
\ No newline at end of file
+
+    TRACE_WRITE(output_name(argc, argv) + "_trace.json");
+
+    return failed_frames > 0 ? 1 : 0;
+}
@@ -3,6 +3,24 @@
 
 #include "hittable.h"
 
+#include <cstdint>
+
+// A material as plain data: its kind and the parameters it was constructed with. Used to save
+// scenes to a binary cache and restore them with make_material().
+enum material_kind : std::uint32_t {
+    material_unknown = 0,
+    material_lambertian,
+    material_metal,
+    material_dielectric,
+    material_diffuse_light
+};
+
+struct material_description {
+    std::uint32_t kind;
+    std::uint32_t reserved;
+    double parameters[4];
+};
+
 class material {
     public:
         virtual ~material() = default;
@@ -12,6 +30,29 @@ class material {
         ) const {
             return false;
         }
+
+        // Radiance emitted from the hit point back along the incoming ray.
+        virtual colour emitted(const ray& r_in, const hit_record& rec) const {
+            return colour(0,0,0);
+        }
+
+        // Solid angle density with which scatter() produces the direction of `scattered`. Zero for
+        // specular materials, whose directions cannot be produced by any other strategy.
+        virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+        const {
+            return 0;
+        }
+
+        // BSDF times the cosine term for light arriving along `scattered` and leaving along the
+        // reversed incoming ray. Zero for specular materials, which cannot be lit by light sampling.
+        virtual colour evaluate(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+            return colour(0,0,0);
+        }
+
+        // Materials that cannot be described this way are reported as material_unknown.
+        virtual material_description describe() const {
+            return { material_unknown, 0, {0, 0, 0, 0} };
+        }
 };
 
 class lambertian : public material {
@@ -35,6 +76,23 @@ class lambertian : public material {
             }
         }
 
+        double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+        const override {
+            auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+            return cos_theta < 0 ? 0 : cos_theta/pi;
+        }
+
+        colour evaluate(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+            // The absorption probability p only affects the scattered path; direct lighting is
+            // always gathered, so the full albedo applies here.
+            auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+            return cos_theta < 0 ? colour(0,0,0) : albedo * (cos_theta/pi);
+        }
+
+        material_description describe() const override {
+            return { material_lambertian, 0, {albedo.x(), albedo.y(), albedo.z(), p} };
+        }
+
     private:
         colour albedo;
         double p;
@@ -53,6 +111,10 @@ class metal : public material {
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        material_description describe() const override {
+            return { material_metal, 0, {albedo.x(), albedo.y(), albedo.z(), fuzz} };
+        }
+
     private:
         colour albedo;
         double fuzz;
@@ -84,6 +146,10 @@ class dielectric : public material {
             return true;
         }
 
+        material_description describe() const override {
+            return { material_dielectric, 0, {refraction_index, 0, 0, 0} };
+        }
+
     private:
         // Refractive index in vacuum or air, or the ratio of the material's refractive index over
         // the refractive index of the enclosing media
@@ -97,5 +163,35 @@ class dielectric : public material {
         } 
 };
 
+class diffuse_light : public material {
+    public:
+        diffuse_light(const colour& emit) : emit(emit) {}
+
+        colour emitted(const ray& r_in, const hit_record& rec) const override {
+            // Lights only emit from their outward-facing side.
+            if (!rec.front_face)
+                return colour(0,0,0);
+            return emit;
+        }
+
+        material_description describe() const override {
+            return { material_diffuse_light, 0, {emit.x(), emit.y(), emit.z(), 0} };
+        }
+
+    private:
+        colour emit;
+};
+
+inline shared_ptr<material> make_material(const material_description& description) {
+    // Recreates a material from describe(), or returns nullptr for unknown kinds.
+    const double* p = description.parameters;
+    switch (description.kind) {
+        case material_lambertian:    return make_shared<lambertian>(colour(p[0], p[1], p[2]), p[3]);
+        case material_metal:         return make_shared<metal>(colour(p[0], p[1], p[2]), p[3]);
+        case material_dielectric:    return make_shared<dielectric>(p[0]);
+        case material_diffuse_light: return make_shared<diffuse_light>(colour(p[0], p[1], p[2]));
+        default:                     return nullptr;
+    }
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+// A group of up to max_size rays traced together, stored as one array per component (structure of
+// arrays) so that intersection tests run the same arithmetic across all rays in tight loops the
+// compiler can vectorise. Rays in a packet should be coherent, such as camera rays through
+// neighbouring pixels; once rays scatter in different directions they are traced one at a time.
+class ray_packet {
+    public:
+        static const int max_size = 64;
+
+        int count = 0;                          // Number of rays in use
+        double t_min = 0.001;                   // Start of the hit interval, shared by every ray
+        double origin_x[max_size], origin_y[max_size], origin_z[max_size];
+        double direction_x[max_size], direction_y[max_size], direction_z[max_size];
+        double time[max_size];
+        double t_max[max_size];                 // Distance to the closest hit so far
+        int    object[max_size];                // Index of the closest object hit so far, or -1
+
+        void clear() { count = 0; }
+
+        void add(const ray& r) {
+            origin_x[count] = r.origin().x();
+            origin_y[count] = r.origin().y();
+            origin_z[count] = r.origin().z();
+            direction_x[count] = r.direction().x();
+            direction_y[count] = r.direction().y();
+            direction_z[count] = r.direction().z();
+            time[count] = r.time();
+            t_max[count] = infinity;
+            object[count] = -1;
+            count++;
+        }
+
+        ray get(int k) const {
+            return ray(point3(origin_x[k], origin_y[k], origin_z[k]),
+                       vec3(direction_x[k], direction_y[k], direction_z[k]), time[k]);
+        }
+};
+
+#endif
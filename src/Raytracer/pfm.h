@@ -0,0 +1,76 @@
+#ifndef PFM_H
+#define PFM_H
+
+#include "colour.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Portable float map (PFM) images hold linear, unclamped RGB, so they are used for reference
+// renders and high dynamic range inputs where 8-bit BMP output would lose information.
+
+inline bool host_is_little_endian() {
+    std::uint32_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+inline void write_pfm(const std::string& filename, int image_width, int image_height, colour** pixel_data) {
+    std::ofstream file(filename, std::ios::binary);
+
+    // A negative scale marks little-endian data. Rows are stored bottom to top.
+    file << "PF\n" << image_width << ' ' << image_height << '\n'
+         << (host_is_little_endian() ? "-1.0" : "1.0") << '\n';
+
+    std::vector<float> row(3 * image_width);
+    for (int j = image_height - 1; j >= 0; j--) {
+        for (int i = 0; i < image_width; i++) {
+            row[3*i + 0] = float(pixel_data[j][i].x());
+            row[3*i + 1] = float(pixel_data[j][i].y());
+            row[3*i + 2] = float(pixel_data[j][i].z());
+        }
+        file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+// Reads a colour PFM image into `pixels`, stored top row first. Returns false if the file is
+// missing or is not a readable colour PFM.
+inline bool read_pfm(const std::string& filename, int& image_width, int& image_height, std::vector<colour>& pixels) {
+    std::ifstream file(filename, std::ios::binary);
+    std::string magic;
+    double scale;
+
+    if (!(file >> magic >> image_width >> image_height >> scale) || magic != "PF"
+        || image_width <= 0 || image_height <= 0)
+        return false;
+    file.get(); // Single whitespace character before the pixel data
+
+    bool swap_bytes = (scale < 0) != host_is_little_endian();
+    std::vector<float> data(3 * size_t(image_width) * image_height);
+    if (!file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float)))
+        return false;
+
+    if (swap_bytes) {
+        for (auto& value : data) {
+            unsigned char bytes[4];
+            std::memcpy(bytes, &value, 4);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+            std::memcpy(&value, bytes, 4);
+        }
+    }
+
+    pixels.resize(size_t(image_width) * image_height);
+    for (int j = 0; j < image_height; j++) {
+        const float* row = &data[3 * size_t(image_height - 1 - j) * image_width];
+        for (int i = 0; i < image_width; i++)
+            pixels[size_t(j) * image_width + i] = colour(row[3*i], row[3*i + 1], row[3*i + 2]);
+    }
+
+    return true;
+}
+
+#endif
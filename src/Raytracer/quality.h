@@ -0,0 +1,42 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include "colour.h"
+
+#include <vector>
+
+// Error of a rendered image against a converged reference of the same scene.
+struct image_error {
+    double rmse;           // Root mean squared error over all pixels and channels
+    double relative_mse;   // Mean squared error relative to the squared reference value
+};
+
+inline image_error compare_to_reference(
+    colour** pixel_data, double scale, const std::vector<colour>& reference, int image_width, int image_height
+) {
+    // `scale` is applied to pixel_data first, so that running sums can be compared mid-render.
+    // Relative MSE uses a small epsilon so that near-black reference pixels do not dominate.
+    const double epsilon = 1e-2;
+    double squared_error = 0;
+    double relative_squared_error = 0;
+
+    for (int j = 0; j < image_height; j++) {
+        for (int i = 0; i < image_width; i++) {
+            colour pixel = scale * pixel_data[j][i];
+            const colour& expected = reference[size_t(j) * image_width + i];
+            for (int c = 0; c < 3; c++) {
+                auto difference = pixel[c] - expected[c];
+                squared_error += difference * difference;
+                relative_squared_error += difference * difference / (expected[c] * expected[c] + epsilon);
+            }
+        }
+    }
+
+    auto count = 3.0 * image_width * image_height;
+    image_error error;
+    error.rmse = std::sqrt(squared_error / count);
+    error.relative_mse = relative_squared_error / count;
+    return error;
+}
+
+#endif
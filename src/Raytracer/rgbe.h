@@ -0,0 +1,97 @@
+#ifndef RGBE_H
+#define RGBE_H
+
+#include "colour.h"
+
+#include <cstring>
+#include <vector>
+
+// Reader for Radiance RGBE (.hdr) images, the usual format for HDR environment maps. Each pixel is
+// stored as three 8-bit mantissas sharing an 8-bit exponent, optionally run-length encoded per
+// scanline.
+
+inline colour rgbe_to_colour(const unsigned char* rgbe) {
+    if (rgbe[3] == 0)
+        return colour(0,0,0);
+    auto f = std::ldexp(1.0, int(rgbe[3]) - (128 + 8));
+    return colour(rgbe[0] * f, rgbe[1] * f, rgbe[2] * f);
+}
+
+inline bool read_rgbe_scanline(std::istream& file, int width, unsigned char* scanline) {
+    // Reads one scanline of `width` RGBE pixels, in either the flat or run-length encoded layout.
+    unsigned char start[4];
+    if (!file.read(reinterpret_cast<char*>(start), 4))
+        return false;
+
+    bool run_length_encoded = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2
+                           && (start[2] & 0x80) == 0 && ((start[2] << 8) | start[3]) == width;
+    if (!run_length_encoded) {
+        std::memcpy(scanline, start, 4);
+        return bool(file.read(reinterpret_cast<char*>(scanline + 4), 4 * (width - 1)));
+    }
+
+    // Encoded scanlines store each of the four components separately as runs and literals.
+    std::vector<unsigned char> component(width);
+    for (int c = 0; c < 4; c++) {
+        int i = 0;
+        while (i < width) {
+            int count = file.get();
+            if (count == EOF)
+                return false;
+            if (count > 128) {
+                count -= 128;
+                int value = file.get();
+                if (value == EOF || i + count > width)
+                    return false;
+                std::memset(&component[i], value, count);
+            } else {
+                if (count == 0 || i + count > width
+                    || !file.read(reinterpret_cast<char*>(&component[i]), count))
+                    return false;
+            }
+            i += count;
+        }
+        for (i = 0; i < width; i++)
+            scanline[4*i + c] = component[i];
+    }
+
+    return true;
+}
+
+// Reads an RGBE image into `pixels`, stored top row first. Only the standard "-Y height +X width"
+// orientation is supported. Returns false if the file is missing or cannot be read.
+inline bool read_rgbe(const std::string& filename, int& image_width, int& image_height, std::vector<colour>& pixels) {
+    std::ifstream file(filename, std::ios::binary);
+    std::string line;
+
+    if (!std::getline(file, line) || line.compare(0, 2, "#?") != 0)
+        return false;
+
+    // Header lines end with an empty line, followed by the resolution string.
+    bool rgbe_format = true;
+    while (std::getline(file, line) && !line.empty()) {
+        if (line.compare(0, 7, "FORMAT=") == 0)
+            rgbe_format = (line == "FORMAT=32-bit_rle_rgbe");
+    }
+
+    std::string y_axis, x_axis;
+    if (!rgbe_format || !std::getline(file, line))
+        return false;
+    std::istringstream resolution(line);
+    if (!(resolution >> y_axis >> image_height >> x_axis >> image_width) || y_axis != "-Y" || x_axis != "+X"
+        || image_width <= 0 || image_height <= 0)
+        return false;
+
+    pixels.resize(size_t(image_width) * image_height);
+    std::vector<unsigned char> scanline(4 * size_t(image_width));
+    for (int j = 0; j < image_height; j++) {
+        if (!read_rgbe_scanline(file, image_width, scanline.data()))
+            return false;
+        for (int i = 0; i < image_width; i++)
+            pixels[size_t(j) * image_width + i] = rgbe_to_colour(&scanline[4*i]);
+    }
+
+    return true;
+}
+
+#endif
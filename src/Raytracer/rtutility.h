@@ -9,6 +9,7 @@
 #include <limits>
 #include <memory>
 #include <sstream>
+#include <string>
 
 // C++ Std Usings
 
@@ -36,6 +37,26 @@ inline double random_double(double min, double max) {
     return min + (max-min)*random_double();
 }
 
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    // Multiple importance sampling weight for a sample drawn from strategy a, given the
+    // density with which strategy b would have produced the same sample.
+    auto a2 = pdf_a * pdf_a;
+    auto b2 = pdf_b * pdf_b;
+    return (a2 + b2 > 0) ? a2 / (a2 + b2) : 0;
+}
+
+inline std::string output_name(int argc, char* argv[]) {
+    // Base name for output files: the first command line argument, or "image" by default.
+    return (argc > 1) ? argv[1] : "image";
+}
+
+inline std::string frame_filename(const std::string& name, int frame, const std::string& suffix) {
+    // Per-frame file names are numbered from 1, e.g. image_0001.bmp.
+    std::stringstream ss;
+    ss << name << "_" << std::setw(4) << std::setfill('0') << frame + 1 << suffix;
+    return ss.str();
+}
+
 inline double clamp(double x, double min, double max) {
     if (x < min) return min;
     if (x > max) return max;
@@ -44,9 +65,12 @@ inline double clamp(double x, double min, double max) {
 
 // Common Headers
 
+#include "aabb.h"
 #include "colour.h"
 #include "interval.h"
+#include "onb.h"
 #include "ray.h"
+#include "trace.h"
 #include "vec3.h"
 #include "transform.h"
 
@@ -0,0 +1,408 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SCENE_CACHE_MMAP 1
+#else
+#include <process.h>
+#endif
+
+// Binary scene cache: a built scene saved as flat arrays of plain records, so later runs can
+// restore it without running the scene's setup code. The file starts with a header giving the
+// format version and the offset of each array from the start of the file, so it does not depend
+// on where it is loaded. Materials are stored once and referenced by index, and spheres that are
+// also sampled as lights are flagged. Files are written in the host's byte order and rejected on
+// hosts with a different one.
+//
+// Loading memory-maps the file read-only where the platform supports it and renders the spheres
+// straight from the mapping, so startup builds nothing per sphere and every render process on a
+// machine shares the same pages from the page cache. Saving writes a temporary file and renames it
+// over the cache, so processes that have the old file mapped keep a complete copy.
+//
+// A cache is only used for the scene name, seed and setup version it was built with. The setup
+// version is chosen by the caller and must change whenever the scene's setup code does, since the
+// cache cannot tell otherwise.
+
+const char scene_cache_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+const std::uint32_t scene_cache_version = 2;
+const std::uint32_t scene_cache_byte_order = 0x01020304;
+
+struct scene_cache_header {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;    // scene_cache_byte_order as written by the host that saved the file
+    char          scene[32];     // Name of the scene the cache was built from
+    std::uint32_t seed;          // Random seed the scene was built with
+    std::uint32_t setup_version; // Version of the scene setup code the scene was built with
+    std::uint32_t material_count;
+    std::uint32_t sphere_count;
+    std::uint64_t camera_offset; // Byte offsets from the start of the file
+    std::uint64_t material_offset;
+    std::uint64_t sphere_offset;
+};
+
+// The camera settings a scene chooses.
+struct cached_camera {
+    double        aspect_ratio;
+    std::int32_t  image_width;
+    std::int32_t  samples_per_pixel;
+    std::int32_t  max_depth;
+    std::int32_t  total_frames;
+    std::int32_t  fps;
+    std::int32_t  sky;
+    double        vfov;
+    double        lookfrom[3];
+    double        lookdir[3];
+    double        vup[3];
+    double        defocus_angle;
+    double        focus_dist;
+    double        shutter_speed;
+    double        background[3];
+};
+
+struct cached_sphere {
+    sphere_description geometry;
+    std::uint32_t      material; // Index into the material array
+    std::uint32_t      is_light; // Nonzero if the sphere is also in the lights list
+};
+
+// A read-only view of a whole file, memory-mapped where possible and read into memory otherwise.
+class mapped_file {
+    public:
+        mapped_file(const std::string& filename) {
+#ifdef SCENE_CACHE_MMAP
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    bytes = static_cast<const char*>(mapping);
+                    length = size_t(info.st_size);
+                }
+            }
+            close(fd);
+#else
+            std::ifstream file(filename, std::ios::binary);
+            if (!file)
+                return;
+            buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            bytes = buffer.data();
+            length = buffer.size();
+#endif
+        }
+
+        ~mapped_file() {
+#ifdef SCENE_CACHE_MMAP
+            if (bytes)
+                munmap(const_cast<char*>(bytes), length);
+#endif
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool valid() const { return bytes != nullptr; }
+        const char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const char* bytes = nullptr;
+        size_t length = 0;
+#ifndef SCENE_CACHE_MMAP
+        std::vector<char> buffer;
+#endif
+};
+
+// The spheres of a scene cache, intersected in place in the file's records. The file stays mapped
+// for as long as the array exists, and the records' material indices are resolved through a table
+// of materials built once when the file is loaded.
+class cached_spheres : public hittable_collection {
+    public:
+        cached_spheres(std::unique_ptr<mapped_file> file, const cached_sphere* records, int count,
+                       std::vector<shared_ptr<material>> materials)
+          : file(std::move(file)), records(records), count(count), materials(std::move(materials)) {}
+
+        int primitive_count() const override { return count; }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return closest_hit(count, [](int k) { return k; }, r, ray_t, rec);
+        }
+
+        bool hit_primitives(const std::vector<int>& indices, const ray& r, interval ray_t, hit_record& rec) const override {
+            return closest_hit(int(indices.size()), [&indices](int k) { return indices[k]; }, r, ray_t, rec);
+        }
+
+        bool hit_primitive(int index, const ray& r, interval ray_t, hit_record& rec) const override {
+            return closest_hit(1, [index](int) { return index; }, r, ray_t, rec);
+        }
+
+        bool closest_hits(const std::vector<int>& indices, ray_packet& packet) const override {
+            bool hit_anything = false;
+            for (int index : indices) {
+                const auto& geometry = records[index].geometry;
+                if (sphere::intersect_packet(packet, index, geometry.radius, [&geometry](double time) { return geometry.centre(time); }))
+                    hit_anything = true;
+            }
+            return hit_anything;
+        }
+
+        aabb primitive_bounding_box(int index, double time0, double time1) const override {
+            const auto& geometry = records[index].geometry;
+            return sphere::bounds(geometry.centre(time0), geometry.centre(time1), geometry.radius);
+        }
+
+        aabb bounding_box(double time0, double time1) const override {
+            aabb bbox = aabb::empty;
+            for (int index = 0; index < count; index++)
+                bbox = aabb(bbox, primitive_bounding_box(index, time0, time1));
+            return bbox;
+        }
+
+    private:
+        std::unique_ptr<mapped_file> file;
+        const cached_sphere* records;
+        int count;
+        std::vector<shared_ptr<material>> materials;
+
+        template <typename F>
+        bool closest_hit(int n, F index_at, const ray& r, interval ray_t, hit_record& rec) const {
+            // Finds the closest of spheres index_at(0) to index_at(n - 1), and only builds the hit
+            // record for that one.
+            int closest = -1;
+            point3 closest_centre;
+            auto closest_so_far = ray_t.max;
+            for (int k = 0; k < n; k++) {
+                const auto& geometry = records[index_at(k)].geometry;
+                point3 current_centre = geometry.centre(r.time());
+                double root;
+                if (sphere::intersect(current_centre, geometry.radius, r, interval(ray_t.min, closest_so_far), root)) {
+                    closest = index_at(k);
+                    closest_centre = current_centre;
+                    closest_so_far = root;
+                }
+            }
+            if (closest < 0)
+                return false;
+
+            const auto& record = records[closest];
+            sphere::record_hit(r, closest_so_far, closest_centre, record.geometry.radius, materials[record.material], rec);
+            return true;
+        }
+};
+
+inline int current_process_id() {
+#ifdef SCENE_CACHE_MMAP
+    return int(getpid());
+#else
+    return _getpid();
+#endif
+}
+
+inline bool save_scene_cache(const std::string& filename, const std::string& scene, unsigned seed,
+                             std::uint32_t setup_version, const hittable_list& world, const hittable_list& lights, const camera& cam) {
+    // Writes the scene to `filename`. Fails without writing anything if the world holds objects
+    // other than spheres, or materials that cannot be described.
+    std::vector<material_description> materials;
+    std::unordered_map<const material*, std::uint32_t> material_index;
+    std::vector<cached_sphere> spheres;
+
+    std::unordered_set<const hittable*> light_objects;
+    for (const auto& light : lights.objects)
+        light_objects.insert(light.get());
+
+    for (const auto& object : world.objects) {
+        auto s = dynamic_cast<const sphere*>(object.get());
+        if (!s) {
+            std::cerr << "Scene cache " << filename << " not written: only spheres can be cached\n";
+            return false;
+        }
+
+        // Shared materials are stored once.
+        const material* mat = s->surface_material().get();
+        auto found = material_index.find(mat);
+        if (found == material_index.end()) {
+            auto description = mat ? mat->describe() : material_description{material_unknown, 0, {0, 0, 0, 0}};
+            if (description.kind == material_unknown) {
+                std::cerr << "Scene cache " << filename << " not written: unsupported material\n";
+                return false;
+            }
+            found = material_index.emplace(mat, std::uint32_t(materials.size())).first;
+            materials.push_back(description);
+        }
+
+        bool is_light = light_objects.count(object.get()) > 0;
+        spheres.push_back({ s->describe(), found->second, is_light ? 1u : 0u });
+    }
+
+    cached_camera settings = {};
+    settings.aspect_ratio = cam.aspect_ratio;
+    settings.image_width = cam.image_width;
+    settings.samples_per_pixel = cam.samples_per_pixel;
+    settings.max_depth = cam.max_depth;
+    settings.total_frames = cam.total_frames;
+    settings.fps = cam.fps;
+    settings.sky = cam.sky ? 1 : 0;
+    settings.vfov = cam.vfov;
+    settings.defocus_angle = cam.defocus_angle;
+    settings.focus_dist = cam.focus_dist;
+    settings.shutter_speed = cam.shutter_speed;
+    for (int axis = 0; axis < 3; axis++) {
+        settings.lookfrom[axis] = cam.lookfrom[axis];
+        settings.lookdir[axis] = cam.lookdir[axis];
+        settings.vup[axis] = cam.vup[axis];
+        settings.background[axis] = cam.background[axis];
+    }
+
+    scene_cache_header header = {};
+    std::memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+    header.version = scene_cache_version;
+    header.byte_order = scene_cache_byte_order;
+    std::strncpy(header.scene, scene.c_str(), sizeof(header.scene) - 1);
+    header.seed = seed;
+    header.setup_version = setup_version;
+    header.material_count = std::uint32_t(materials.size());
+    header.sphere_count = std::uint32_t(spheres.size());
+    header.camera_offset = sizeof(header);
+    header.material_offset = header.camera_offset + sizeof(settings);
+    header.sphere_offset = header.material_offset + materials.size() * sizeof(material_description);
+
+    // Each process writes its own temporary file, and the rename replaces the cache in one step.
+    auto temporary = filename + ".tmp." + std::to_string(current_process_id());
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(&settings), sizeof(settings));
+        file.write(reinterpret_cast<const char*>(materials.data()), std::streamsize(materials.size() * sizeof(material_description)));
+        file.write(reinterpret_cast<const char*>(spheres.data()), std::streamsize(spheres.size() * sizeof(cached_sphere)));
+        file.close();
+        if (!file) {
+            std::cerr << "Could not write scene cache " << filename << '\n';
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+
+    bool renamed = std::rename(temporary.c_str(), filename.c_str()) == 0;
+#ifndef SCENE_CACHE_MMAP
+    // Windows does not rename over an existing file. Nothing maps the file there, so it can be
+    // removed first.
+    if (!renamed) {
+        std::remove(filename.c_str());
+        renamed = std::rename(temporary.c_str(), filename.c_str()) == 0;
+    }
+#endif
+    if (!renamed) {
+        std::cerr << "Could not replace scene cache " << filename << '\n';
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline shared_ptr<cached_spheres> load_scene_cache(const std::string& filename, const std::string& scene, unsigned seed,
+                                                   std::uint32_t setup_version, hittable_list& lights, camera& cam) {
+    // Restores a scene saved by save_scene_cache(), returning its spheres to be rendered in place.
+    // Returns null, leaving the lights and camera untouched, if the file is missing, was built for
+    // another scene, seed, setup or format version, or is damaged.
+    std::unique_ptr<mapped_file> file(new mapped_file(filename));
+    if (!file->valid() || file->size() < sizeof(scene_cache_header))
+        return nullptr;
+
+    scene_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0
+        || header.version != scene_cache_version || header.byte_order != scene_cache_byte_order) {
+        std::cerr << "Ignoring scene cache " << filename << ": unsupported format\n";
+        return nullptr;
+    }
+    header.scene[sizeof(header.scene) - 1] = '\0';
+    if (scene != header.scene || seed != header.seed || setup_version != header.setup_version)
+        return nullptr;
+
+    auto fits = [&](std::uint64_t offset, std::uint64_t bytes) {
+        return offset <= file->size() && bytes <= file->size() - offset;
+    };
+    if (!fits(header.camera_offset, sizeof(cached_camera))
+        || !fits(header.material_offset, std::uint64_t(header.material_count) * sizeof(material_description))
+        || !fits(header.sphere_offset, std::uint64_t(header.sphere_count) * sizeof(cached_sphere))) {
+        std::cerr << "Ignoring scene cache " << filename << ": file is truncated\n";
+        return nullptr;
+    }
+
+    // The sphere records are used where they lie in the mapping, which is page aligned, so their
+    // offset must suit the record's alignment. save_scene_cache() always writes them that way.
+    const char* sphere_bytes = file->data() + header.sphere_offset;
+    if (reinterpret_cast<std::uintptr_t>(sphere_bytes) % alignof(cached_sphere) != 0) {
+        std::cerr << "Ignoring scene cache " << filename << ": misaligned sphere records\n";
+        return nullptr;
+    }
+    auto records = reinterpret_cast<const cached_sphere*>(sphere_bytes);
+
+    std::vector<shared_ptr<material>> materials(header.material_count);
+    for (std::uint32_t index = 0; index < header.material_count; index++) {
+        material_description description;
+        std::memcpy(&description, file->data() + header.material_offset + index * sizeof(description), sizeof(description));
+        materials[index] = make_material(description);
+        if (!materials[index]) {
+            std::cerr << "Ignoring scene cache " << filename << ": unknown material\n";
+            return nullptr;
+        }
+    }
+
+    // Material indices are checked once here so that rendering can use them unchecked. Only the
+    // few spheres sampled as lights are built as objects, for the lights list.
+    hittable_list cached_lights;
+    for (std::uint32_t index = 0; index < header.sphere_count; index++) {
+        const auto& record = records[index];
+        if (record.material >= header.material_count) {
+            std::cerr << "Ignoring scene cache " << filename << ": bad material index\n";
+            return nullptr;
+        }
+        if (record.is_light)
+            cached_lights.add(make_shared<sphere>(record.geometry, materials[record.material]));
+    }
+
+    cached_camera settings;
+    std::memcpy(&settings, file->data() + header.camera_offset, sizeof(settings));
+    cam.aspect_ratio = settings.aspect_ratio;
+    cam.image_width = settings.image_width;
+    cam.samples_per_pixel = settings.samples_per_pixel;
+    cam.max_depth = settings.max_depth;
+    cam.total_frames = settings.total_frames;
+    cam.fps = settings.fps;
+    cam.sky = settings.sky != 0;
+    cam.vfov = settings.vfov;
+    cam.lookfrom = point3(settings.lookfrom[0], settings.lookfrom[1], settings.lookfrom[2]);
+    cam.lookdir = vec3(settings.lookdir[0], settings.lookdir[1], settings.lookdir[2]);
+    cam.vup = vec3(settings.vup[0], settings.vup[1], settings.vup[2]);
+    cam.defocus_angle = settings.defocus_angle;
+    cam.focus_dist = settings.focus_dist;
+    cam.shutter_speed = settings.shutter_speed;
+    cam.background = colour(settings.background[0], settings.background[1], settings.background[2]);
+
+    lights = std::move(cached_lights);
+    return make_shared<cached_spheres>(std::move(file), records, int(header.sphere_count), std::move(materials));
+}
+
+#endif
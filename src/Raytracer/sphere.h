@@ -3,6 +3,22 @@
 
 #include "hittable.h"
 
+struct sphere_description {
+    double start_centre[3]; // Centre at start_time
+    double end_centre[3];   // Centre at end_time
+    double start_time;
+    double end_time;
+    double radius;
+
+    // Centre at `time`, moved as animated_transform moves a sphere's centre.
+    point3 centre(double time) const {
+        point3 from(start_centre[0], start_centre[1], start_centre[2]);
+        point3 to(end_centre[0], end_centre[1], end_centre[2]);
+        if (!(from != to)) return from;
+        return animated_transform::interpolate(from, to, start_time, end_time, time);
+    }
+};
+
 class sphere : public hittable {
     public:
         // Stationary sphere
@@ -13,9 +29,33 @@ class sphere : public hittable {
         sphere(const animated_transform& transform, double radius, shared_ptr<material> mat)
           : transform(transform), radius(std::fmax(0, radius)), mat(mat) {}
 
+        // Sphere rebuilt from describe()
+        sphere(const sphere_description& d, shared_ptr<material> mat)
+          : sphere(animated_transform(point3(d.start_centre[0], d.start_centre[1], d.start_centre[2]),
+                                      point3(d.end_centre[0], d.end_centre[1], d.end_centre[2]),
+                                      d.start_time, d.end_time),
+                   d.radius, mat) {}
+
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
             point3 current_centre = transform.apply_inverse(r.origin(), r.time());
-            vec3 oc = current_centre - r.origin();
+            double root;
+            if (!intersect(current_centre, radius, r, ray_t, root))
+                return false;
+            record_hit(r, root, current_centre, radius, mat, rec);
+            return true;
+        }
+
+        bool hit_packet(ray_packet& packet, int id) const override {
+            return intersect_packet(packet, id, radius, [this](double time) {
+                return transform.apply_inverse(point3(0,0,0), time);
+            });
+        }
+
+        // The intersection tests shared with the flat sphere array of a scene cache (scene_cache.h).
+
+        static bool intersect(const point3& centre, double radius, const ray& r, interval ray_t, double& root) {
+            // Finds the nearest root that lies in ray_t, if any.
+            vec3 oc = centre - r.origin();
             auto a = r.direction().length_squared();
             auto h = dot(r.direction(), oc);
             auto c = oc.length_squared() - radius*radius;
@@ -26,21 +66,117 @@ class sphere : public hittable {
 
             auto sqrtd = std::sqrt(discriminant);
 
-            // Find the nearest root that lies in the acceptable range.
-            auto root = (h - sqrtd) / a;
+            root = (h - sqrtd) / a;
             if (!ray_t.surrounds(root)) {
                 root = (h + sqrtd) / a;
                 if (!ray_t.surrounds(root)) 
                     return false;
             }
+            return true;
+        }
 
+        static void record_hit(const ray& r, double root, const point3& centre, double radius,
+                               const shared_ptr<material>& mat, hit_record& rec) {
             rec.t = root;
             rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - current_centre) / radius;
+            vec3 outward_normal = (rec.p - centre) / radius;
             rec.set_face_normal(r, outward_normal);
             rec.mat = mat;
+        }
 
-            return true;
+        template <typename F>
+        static bool intersect_packet(ray_packet& packet, int id, double radius, F centre_at) {
+            // The same test as hit(), run across the packet's rays in two passes, for a sphere
+            // whose centre at a given time is centre_at(time). The first pass only computes
+            // discriminants, so packets that miss entirely stop there.
+            double centre_x[ray_packet::max_size], centre_y[ray_packet::max_size], centre_z[ray_packet::max_size];
+            double a[ray_packet::max_size], h[ray_packet::max_size], discriminant[ray_packet::max_size];
+            int count = packet.count;
+
+            for (int k = 0; k < count; k++) {
+                point3 current_centre = centre_at(packet.time[k]);
+                centre_x[k] = current_centre.x();
+                centre_y[k] = current_centre.y();
+                centre_z[k] = current_centre.z();
+            }
+
+            for (int k = 0; k < count; k++) {
+                auto oc_x = centre_x[k] - packet.origin_x[k];
+                auto oc_y = centre_y[k] - packet.origin_y[k];
+                auto oc_z = centre_z[k] - packet.origin_z[k];
+                auto d_x = packet.direction_x[k], d_y = packet.direction_y[k], d_z = packet.direction_z[k];
+                a[k] = d_x*d_x + d_y*d_y + d_z*d_z;
+                h[k] = d_x*oc_x + d_y*oc_y + d_z*oc_z;
+                auto c = oc_x*oc_x + oc_y*oc_y + oc_z*oc_z - radius*radius;
+                discriminant[k] = h[k]*h[k] - a[k]*c;
+            }
+
+            int rays_with_roots = 0;
+            for (int k = 0; k < count; k++)
+                rays_with_roots += discriminant[k] >= 0;
+            if (rays_with_roots == 0)
+                return false;
+
+            bool hit_any = false;
+            for (int k = 0; k < count; k++) {
+                if (discriminant[k] < 0)
+                    continue;
+                auto sqrtd = std::sqrt(discriminant[k]);
+                auto root = (h[k] - sqrtd) / a[k];
+                if (root <= packet.t_min || root >= packet.t_max[k])
+                    root = (h[k] + sqrtd) / a[k];
+                if (root > packet.t_min && root < packet.t_max[k]) {
+                    packet.t_max[k] = root;
+                    packet.object[k] = id;
+                    hit_any = true;
+                }
+            }
+            return hit_any;
+        }
+
+        static aabb bounds(const point3& centre0, const point3& centre1, double radius) {
+            // The centre moves along a straight line, so the boxes around its positions at the two
+            // times enclose it throughout.
+            auto rvec = vec3(radius, radius, radius);
+            return aabb(aabb(centre0 - rvec, centre0 + rvec), aabb(centre1 - rvec, centre1 + rvec));
+        }
+
+        // The sphere's geometry as plain data, from which it can be rebuilt; see scene_cache.h.
+        sphere_description describe() const {
+            const auto& from = transform.start_position();
+            const auto& to = transform.end_position();
+            return { {from.x(), from.y(), from.z()}, {to.x(), to.y(), to.z()},
+                     transform.start(), transform.end(), radius };
+        }
+
+        const shared_ptr<material>& surface_material() const { return mat; }
+
+        aabb bounding_box(double time0, double time1) const override {
+            return bounds(transform.apply_inverse(point3(0,0,0), time0), transform.apply_inverse(point3(0,0,0), time1), radius);
+        }
+
+        double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+            // Only valid for spheres seen from outside: samples are uniform over the cone of
+            // directions that the sphere subtends from `origin`.
+            hit_record rec;
+            if (!this->hit(ray(origin, direction, time), interval(0.001, infinity), rec))
+                return 0;
+
+            auto distance_squared = (transform.apply_inverse(origin, time) - origin).length_squared();
+            if (distance_squared <= radius*radius)
+                return 0;
+
+            auto cos_theta_max = std::sqrt(1 - radius*radius/distance_squared);
+            auto solid_angle = 2*pi*(1 - cos_theta_max);
+
+            return 1 / solid_angle;
+        }
+
+        vec3 random(const point3& origin, double time) const override {
+            vec3 direction = transform.apply_inverse(origin, time) - origin;
+            auto distance_squared = direction.length_squared();
+            onb uvw(direction);
+            return uvw.transform(random_to_sphere(radius, distance_squared));
         }
 
         private:
@@ -48,6 +184,21 @@ class sphere : public hittable {
             double radius;
             shared_ptr<material> mat;
             animated_transform transform;
+
+            static vec3 random_to_sphere(double radius, double distance_squared) {
+                // Uniform direction within the cone around +z subtended by a sphere of the given
+                // radius at the given squared distance.
+                auto r1 = random_double();
+                auto r2 = random_double();
+                auto cos_theta_max = std::sqrt(std::fmax(0.0, 1 - radius*radius/distance_squared));
+                auto z = 1 + r2*(cos_theta_max - 1);
+
+                auto phi = 2*pi*r1;
+                auto x = std::cos(phi) * std::sqrt(1 - z*z);
+                auto y = std::sin(phi) * std::sqrt(1 - z*z);
+
+                return vec3(x, y, z);
+            }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Optional timeline tracing. When built with RAYTRACER_TRACE defined, scoped events are recorded
+// into per-thread ring buffers and can be written out as Chrome Trace Event JSON, which opens in
+// Perfetto (ui.perfetto.dev) or chrome://tracing. Otherwise the macros below expand to nothing.
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef RAYTRACER_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct trace_event {
+    const char* name;       // Event name; must be a string literal
+    const char* arg_name;   // Optional argument name, or nullptr
+    long long   arg_value;  // Argument value, if arg_name is set
+    double      start;      // Start time in microseconds since the trace epoch
+    double      duration;   // Duration in microseconds
+};
+
+class trace_buffer {
+    public:
+        static const size_t capacity = 1 << 16; // Must be a power of two
+
+        trace_buffer(int thread_id) : thread_id(thread_id), events(capacity) {}
+
+        // Only the owning thread pushes, so no lock is needed. Once full, the oldest events are
+        // overwritten.
+        void push(const trace_event& event) {
+            auto index = head.load(std::memory_order_relaxed);
+            events[index & (capacity - 1)] = event;
+            head.store(index + 1, std::memory_order_release);
+        }
+
+        // Calls f for each retained event, oldest first. Only safe once the owning thread has
+        // stopped recording.
+        template <typename F>
+        void for_each(F f) const {
+            auto end = head.load(std::memory_order_acquire);
+            auto begin = (end > capacity) ? end - capacity : 0;
+            for (auto index = begin; index < end; index++)
+                f(events[index & (capacity - 1)]);
+        }
+
+        const int thread_id;
+
+    private:
+        std::vector<trace_event> events;
+        std::atomic<size_t> head{0};
+};
+
+class trace_registry {
+    public:
+        static trace_registry& instance() {
+            static trace_registry registry;
+            return registry;
+        }
+
+        // The calling thread's buffer, registered on first use. The registry owns the buffers so
+        // their events outlive the threads that recorded them.
+        trace_buffer& local_buffer() {
+            thread_local trace_buffer* buffer = nullptr;
+            if (!buffer) {
+                std::lock_guard<std::mutex> lock(mutex);
+                buffers.push_back(std::unique_ptr<trace_buffer>(new trace_buffer(int(buffers.size()) + 1)));
+                buffer = buffers.back().get();
+            }
+            return *buffer;
+        }
+
+        double now() const {
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        // Writes every recorded event as Chrome Trace Event JSON. Call once recording threads are done.
+        void write_json(const std::string& filename) {
+            std::ofstream file(filename);
+            file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+            std::lock_guard<std::mutex> lock(mutex);
+            bool first = true;
+            for (const auto& buffer : buffers) {
+                int tid = buffer->thread_id;
+                buffer->for_each([&](const trace_event& event) {
+                    file << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name
+                         << "\",\"cat\":\"raytracer\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                         << std::fixed << std::setprecision(3)
+                         << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+                    if (event.arg_name)
+                        file << ",\"args\":{\"" << event.arg_name << "\":" << event.arg_value << "}";
+                    file << "}";
+                    first = false;
+                });
+            }
+
+            file << "\n]}\n";
+            std::clog << "Trace written to " << filename << '\n';
+        }
+
+    private:
+        trace_registry() : epoch(std::chrono::steady_clock::now()) {}
+
+        std::chrono::steady_clock::time_point epoch;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<trace_buffer>> buffers;
+};
+
+class trace_scope {
+    public:
+        trace_scope(const char* name, const char* arg_name = nullptr, long long arg_value = 0)
+          : name(name), arg_name(arg_name), arg_value(arg_value), start(trace_registry::instance().now()) {}
+
+        ~trace_scope() {
+            auto& registry = trace_registry::instance();
+            trace_event event = { name, arg_name, arg_value, start, registry.now() - start };
+            registry.local_buffer().push(event);
+        }
+
+    private:
+        const char* name;
+        const char* arg_name;
+        long long arg_value;
+        double start;
+};
+
+// Records an event covering the rest of the enclosing scope.
+#define TRACE_SCOPE(name) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+// As TRACE_SCOPE, with one named integer argument shown alongside the event.
+#define TRACE_SCOPE_ARG(name, arg_name, arg_value) \
+    trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name, arg_name, arg_value)
+// Writes all events recorded so far to the given file.
+#define TRACE_WRITE(filename) trace_registry::instance().write_json(filename)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, arg_name, arg_value)
+#define TRACE_WRITE(filename)
+
+#endif
+
+#endif
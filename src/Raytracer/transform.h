@@ -12,19 +12,26 @@ class animated_transform {
 
         bool is_animated() const { return actually_animated; }
 
+        const point3& start_position() const { return start_pos; }
+        const point3& end_position() const { return end_pos; }
+        double start() const { return start_time; }
+        double end() const { return end_time; }
+
         point3 apply_inverse(const point3& p, double time) const {
             if (!actually_animated) return start_pos;
-            return interpolate(time);
+            return interpolate(start_pos, end_pos, start_time, end_time, time);
         }
 
-    private:
-        point3 interpolate(double time) const {
+        static point3 interpolate(const point3& start_pos, const point3& end_pos, double start_time, double end_time,
+                                  double time) {
             // Linear interpolation between start_pos and end_pos
             double t = (time - start_time) / (end_time - start_time);
             t = clamp(t, 0.0, 1.0);
             return (1.0 - t) * start_pos + t * end_pos;
         }
 
+    private:
+
         point3 start_pos, end_pos;
         double start_time, end_time;
         bool actually_animated = false;